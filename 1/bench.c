@@ -0,0 +1,674 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "coro_chan.h"
+
+/**
+ * Micro-benchmarks of libcoro. Each benchmark prints one line
+ * with its name and the measured cost. Run './bench' for all of
+ * them or './bench <name>' for a single one.
+ */
+
+static double
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+enum {
+	BENCH_YIELD_CORO_COUNT = 2,
+	BENCH_YIELD_ITERATIONS = 5000000,
+};
+
+static int
+bench_yield_f(void *arg)
+{
+	int count = *(int *)arg;
+	for (int i = 0; i < count; ++i)
+		coro_yield();
+	return 0;
+}
+
+/**
+ * Ping-pong between a couple of coroutines. Each coro_yield() is
+ * exactly one context switch.
+ */
+static void
+bench_yield(void)
+{
+	int count = BENCH_YIELD_ITERATIONS;
+	coro_sched_init();
+	for (int i = 0; i < BENCH_YIELD_CORO_COUNT; ++i)
+		coro_new(bench_yield_f, &count);
+	double start = bench_now_ns();
+	struct coro *c;
+	long long switches = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	double total = bench_now_ns() - start;
+	printf("yield: %lld switches, %.2f ns per coro_yield()\n",
+	       switches, total / switches);
+}
+
+enum {
+	BENCH_CREATE_BATCH = 1000,
+	BENCH_CREATE_ROUNDS = 100,
+};
+
+static int
+bench_create_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/**
+ * Create short-living coroutines in batches, run them to the
+ * end and delete. Reported is the whole life cycle cost.
+ */
+static void
+bench_create(void)
+{
+	coro_sched_init();
+	/* The pool is sized for a whole batch. */
+	coro_stack_pool_set_size(BENCH_CREATE_BATCH);
+	double create_total = 0;
+	double start = bench_now_ns();
+	for (int r = 0; r < BENCH_CREATE_ROUNDS; ++r) {
+		double create_start = bench_now_ns();
+		for (int i = 0; i < BENCH_CREATE_BATCH; ++i)
+			coro_new(bench_create_f, NULL);
+		create_total += bench_now_ns() - create_start;
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	double total = bench_now_ns() - start;
+	int count = BENCH_CREATE_BATCH * BENCH_CREATE_ROUNDS;
+	struct coro_stack_pool_stat stat;
+	coro_stack_pool_stat(&stat);
+	printf("create: %d coroutines, %.0f coro_new() per second, "
+	       "%.2f us per create + run + delete\n", count,
+	       count / create_total * 1e9, total / count / 1000);
+	printf("\tstack pool: %lld hits, %lld misses\n", stat.hits,
+	       stat.misses);
+}
+
+enum {
+	/** Total switches per run, split between the coroutines. */
+	BENCH_SCHED_SWITCHES = 2000000,
+	BENCH_SCHED_STACK_SIZE = 16 * 1024,
+};
+
+/**
+ * The same amount of switches done by more and more coroutines.
+ * The cost per switch should not depend on the coroutine count.
+ * Finishes are included, they go through coro_sched_wait().
+ */
+static void
+bench_sched(void)
+{
+	struct coro_attr attr = {.stack_size = BENCH_SCHED_STACK_SIZE};
+	for (int count = 10; count <= 10000; count *= 10) {
+		int yields = BENCH_SCHED_SWITCHES / count;
+		coro_sched_init();
+		for (int i = 0; i < count; ++i)
+			coro_new_ex(bench_yield_f, &yields, &attr);
+		double start = bench_now_ns();
+		struct coro *c;
+		long long switches = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		double total = bench_now_ns() - start;
+		printf("sched: %5d coroutines, %lld switches, %.2f ns per "
+		       "switch\n", count, switches, total / switches);
+	}
+}
+
+enum {
+	BENCH_MT_CORO_COUNT = 64,
+	/** Work of one coroutine, split into chunks between yields. */
+	BENCH_MT_CHUNKS = 200,
+	BENCH_MT_CHUNK_SIZE = 50000,
+};
+
+static int
+bench_mt_f(void *arg)
+{
+	volatile unsigned *sink = arg;
+	unsigned x = 1;
+	for (int i = 0; i < BENCH_MT_CHUNKS; ++i) {
+		for (int j = 0; j < BENCH_MT_CHUNK_SIZE; ++j)
+			x = x * 1103515245 + 12345;
+		coro_yield();
+	}
+	*sink = x;
+	return 0;
+}
+
+/**
+ * CPU-bound coroutines run by more and more worker threads. 0
+ * workers means the coroutines run in the main thread.
+ */
+static void
+bench_mt(void)
+{
+	unsigned sink;
+	double base = 0;
+	for (int workers = 0; workers <= 8; workers = workers * 2 + 1) {
+		coro_sched_init_workers(workers);
+		double start = bench_now_ns();
+		for (int i = 0; i < BENCH_MT_CORO_COUNT; ++i)
+			coro_new(bench_mt_f, &sink);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		double total = bench_now_ns() - start;
+		coro_sched_destroy();
+		if (workers == 0)
+			base = total;
+		printf("mt: %d workers, %.1f ms, speed-up %.2f\n", workers,
+		       total / 1e6, base / total);
+	}
+}
+
+enum {
+	BENCH_QUANTUM_CHECKS = 50000000,
+	BENCH_QUANTUM_NS = 1000 * 1000,
+};
+
+static int
+bench_quantum_f(void *arg)
+{
+	int *yields = arg;
+	for (int i = 0; i < BENCH_QUANTUM_CHECKS; ++i)
+		*yields += coro_yield_if_expired();
+	return 0;
+}
+
+/**
+ * Cost of a quantum check in a hot loop, the switches on expiry
+ * included. Two coroutines share the CPU in 1ms slices.
+ */
+static void
+bench_quantum(void)
+{
+	struct coro_attr attr = {.quantum = BENCH_QUANTUM_NS};
+	int yields = 0;
+	coro_sched_init();
+	coro_new_ex(bench_quantum_f, &yields, &attr);
+	coro_new_ex(bench_quantum_f, &yields, &attr);
+	double start = bench_now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double total = bench_now_ns() - start;
+	printf("quantum: %d checks, %d yields, %.2f ns per "
+	       "coro_yield_if_expired()\n", 2 * BENCH_QUANTUM_CHECKS, yields,
+	       total / (2 * BENCH_QUANTUM_CHECKS));
+}
+
+enum {
+	BENCH_ALLOC_ROUNDS = 2000000,
+	/** Allocations made and freed in one round, LIFO. */
+	BENCH_ALLOC_DEPTH = 8,
+};
+
+static int
+bench_alloc_f(void *arg)
+{
+	bool use_arena = *(bool *)arg;
+	void *ptrs[BENCH_ALLOC_DEPTH];
+	for (int r = 0; r < BENCH_ALLOC_ROUNDS; ++r) {
+		for (int i = 0; i < BENCH_ALLOC_DEPTH; ++i) {
+			size_t size = 16 << (i % 8);
+			ptrs[i] = use_arena ? coro_alloc(size) : malloc(size);
+			*(volatile char *)ptrs[i] = 0;
+		}
+		if (use_arena) {
+			coro_arena_free(ptrs[0]);
+			continue;
+		}
+		for (int i = BENCH_ALLOC_DEPTH - 1; i >= 0; --i)
+			free(ptrs[i]);
+	}
+	return 0;
+}
+
+/**
+ * Nested temporary buffers, like in a recursive merge sort, taken
+ * from malloc() and from the coroutine arena.
+ */
+static void
+bench_alloc(void)
+{
+	bool use_arena[] = {false, true};
+	for (int i = 0; i < 2; ++i) {
+		coro_sched_init();
+		coro_new(bench_alloc_f, &use_arena[i]);
+		double start = bench_now_ns();
+		coro_delete(coro_sched_wait());
+		double total = bench_now_ns() - start;
+		printf("alloc: %s, %.2f ns per allocation + free\n",
+		       use_arena[i] ? "coro_alloc()" : "malloc()",
+		       total / BENCH_ALLOC_ROUNDS / BENCH_ALLOC_DEPTH);
+	}
+}
+
+enum {
+	/**
+	 * Each stack with its guard page takes 2 mappings, and the
+	 * default vm.max_map_count is 65530.
+	 */
+	BENCH_SLEEP_CORO_COUNT = 30000,
+	BENCH_SLEEP_ROUNDS = 4,
+	/** Sleep durations are spread up to that, in nanoseconds. */
+	BENCH_SLEEP_MAX = 200 * 1000 * 1000,
+	BENCH_SLEEP_STACK_SIZE = 16 * 1024,
+};
+
+static int
+bench_sleep_f(void *arg)
+{
+	unsigned seed = (unsigned)(size_t)arg;
+	for (int i = 0; i < BENCH_SLEEP_ROUNDS; ++i) {
+		seed = seed * 1103515245 + 12345;
+		coro_sleep(seed % BENCH_SLEEP_MAX);
+	}
+	return 0;
+}
+
+static double
+bench_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return 1e9 * ts.tv_sec + ts.tv_nsec;
+}
+
+/**
+ * Many coroutines sleeping for random durations at once. The CPU
+ * time shows the timer cost, the rest of the wall time the
+ * scheduler spends blocked in the kernel.
+ */
+static void
+bench_sleep(void)
+{
+	struct coro_attr attr = {.stack_size = BENCH_SLEEP_STACK_SIZE};
+	coro_sched_init();
+	coro_stack_pool_set_size(BENCH_SLEEP_CORO_COUNT);
+	for (int i = 0; i < BENCH_SLEEP_CORO_COUNT; ++i)
+		coro_new_ex(bench_sleep_f, (void *)(size_t)i, &attr);
+	double start = bench_now_ns();
+	double cpu_start = bench_cpu_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double total = bench_now_ns() - start;
+	double cpu = bench_cpu_ns() - cpu_start;
+	int timers = BENCH_SLEEP_CORO_COUNT * BENCH_SLEEP_ROUNDS;
+	printf("sleep: %d coroutines, %d timers, %.1f ms wall, %.1f ms "
+	       "CPU, %.0f ns CPU per timer\n", BENCH_SLEEP_CORO_COUNT, timers,
+	       total / 1e6, cpu / 1e6, cpu / timers);
+	coro_stack_pool_set_size(0);
+}
+
+enum {
+	BENCH_CHAN_MESSAGES = 2000000,
+};
+
+struct bench_chan_arg {
+	struct coro_chan *in;
+	struct coro_chan *out;
+};
+
+/** Send a message to the partner and wait for the answer. */
+static int
+bench_chan_ping_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	void *msg;
+	for (size_t i = 0; i < BENCH_CHAN_MESSAGES; ++i) {
+		coro_chan_send(a->out, (void *)i);
+		coro_chan_recv(a->in, &msg);
+	}
+	coro_chan_close(a->out);
+	return 0;
+}
+
+/** Send back everything received. */
+static int
+bench_chan_pong_f(void *arg)
+{
+	struct bench_chan_arg *a = arg;
+	void *msg;
+	while (coro_chan_recv(a->in, &msg) == 0)
+		coro_chan_send(a->out, msg);
+	return 0;
+}
+
+/** Stream the messages in one direction. */
+static int
+bench_chan_producer_f(void *arg)
+{
+	struct coro_chan *ch = arg;
+	for (size_t i = 0; i < BENCH_CHAN_MESSAGES; ++i)
+		coro_chan_send(ch, (void *)i);
+	coro_chan_close(ch);
+	return 0;
+}
+
+static int
+bench_chan_consumer_f(void *arg)
+{
+	void *msg;
+	while (coro_chan_recv(arg, &msg) == 0)
+		;
+	return 0;
+}
+
+/**
+ * Ping-pong over a pair of channels, each message goes straight
+ * to the waiting receiver. Then one-way streaming through a
+ * buffer, where a switch is made once per buffer fill.
+ */
+static void
+bench_chan(void)
+{
+	int capacities[] = {0, 1};
+	for (int i = 0; i < 2; ++i) {
+		coro_sched_init();
+		struct coro_chan *ping = coro_chan_new(capacities[i]);
+		struct coro_chan *pong = coro_chan_new(capacities[i]);
+		struct bench_chan_arg ping_arg = {pong, ping};
+		struct bench_chan_arg pong_arg = {ping, pong};
+		coro_new(bench_chan_ping_f, &ping_arg);
+		coro_new(bench_chan_pong_f, &pong_arg);
+		double start = bench_now_ns();
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+		double total = bench_now_ns() - start;
+		coro_chan_delete(ping);
+		coro_chan_delete(pong);
+		int count = 2 * BENCH_CHAN_MESSAGES;
+		printf("chan: ping-pong, capacity %d, %.2f M msgs/sec, "
+		       "%.1f ns per message\n", capacities[i],
+		       count / total * 1e3, total / count);
+	}
+	int capacity = 64;
+	coro_sched_init();
+	struct coro_chan *ch = coro_chan_new(capacity);
+	coro_new(bench_chan_producer_f, ch);
+	coro_new(bench_chan_consumer_f, ch);
+	double start = bench_now_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double total = bench_now_ns() - start;
+	coro_chan_delete(ch);
+	printf("chan: stream, capacity %d, %.2f M msgs/sec, %.1f ns per "
+	       "message\n", capacity, BENCH_CHAN_MESSAGES / total * 1e3,
+	       total / BENCH_CHAN_MESSAGES);
+}
+
+enum {
+	BENCH_TRACE_EVENTS = 1 << 16,
+};
+
+/** Ping-pong of two coroutines, nanoseconds per switch. */
+static double
+bench_trace_run(void)
+{
+	int count = BENCH_YIELD_ITERATIONS;
+	coro_new(bench_yield_f, &count);
+	coro_new(bench_yield_f, &count);
+	double start = bench_now_ns();
+	struct coro *c;
+	long long switches = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		switches += coro_switch_count(c);
+		coro_delete(c);
+	}
+	return (bench_now_ns() - start) / switches;
+}
+
+/**
+ * Cost of a switch with tracing compiled in, but off, and on.
+ * Compare the former with the 'yield' bench of a build without
+ * CORO_TRACE.
+ */
+static void
+bench_trace(void)
+{
+	coro_sched_init();
+	double off = bench_trace_run();
+	if (coro_trace_start(BENCH_TRACE_EVENTS) != 0) {
+		printf("trace: not built, define CORO_TRACE\n");
+		return;
+	}
+	double on = bench_trace_run();
+	coro_trace_stop();
+	printf("trace: %.2f ns per switch off, %.2f ns on, %.2f ns "
+	       "per event\n", off, on, on - off);
+}
+
+enum {
+	BENCH_IDLE_CORO_COUNT = 100000,
+};
+
+/** A number from a "Name: value" line of a /proc file. */
+static long long
+bench_proc_value(const char *path, const char *name)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	long long res = -1;
+	size_t len = strlen(name);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, name, len) == 0 && line[len] == ':') {
+			res = atoll(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
+
+static int
+bench_idle_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return 0;
+}
+
+/**
+ * Memory taken by suspended coroutines, with the default and with
+ * small stacks. Each stack with its guard page takes 2 mappings,
+ * so the count is capped by vm.max_map_count.
+ */
+static void
+bench_idle(void)
+{
+	int count = BENCH_IDLE_CORO_COUNT;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	int max_map_count;
+	if (f != NULL && fscanf(f, "%d", &max_map_count) == 1 &&
+	    max_map_count / 2 - 1000 < count)
+		count = max_map_count / 2 - 1000;
+	if (f != NULL)
+		fclose(f);
+	size_t stack_sizes[] = {0, 16 * 1024};
+	struct coro **coros = malloc(count * sizeof(coros[0]));
+	for (int i = 0; i < 2; ++i) {
+		struct coro_attr attr = {.stack_size = stack_sizes[i]};
+		coro_sched_init();
+		coro_stack_pool_set_size(0);
+		long long rss = bench_proc_value("/proc/self/status", "VmRSS");
+		long long vm = bench_proc_value("/proc/self/status", "VmSize");
+		long long commit = bench_proc_value("/proc/meminfo",
+						    "Committed_AS");
+		for (int j = 0; j < count; ++j)
+			coros[j] = coro_new_ex(bench_idle_f, NULL, &attr);
+		/* All of them start and suspend. */
+		if (coro_sched_wait() != NULL)
+			abort();
+		rss = bench_proc_value("/proc/self/status", "VmRSS") - rss;
+		vm = bench_proc_value("/proc/self/status", "VmSize") - vm;
+		commit = bench_proc_value("/proc/meminfo", "Committed_AS") -
+			 commit;
+		printf("idle: %d coroutines, %zu KiB stacks, per coroutine: "
+		       "%.1f KiB resident, %.0f KiB virtual, %.1f KiB "
+		       "committed\n", count, stack_sizes[i] == 0 ? 1024 :
+		       stack_sizes[i] / 1024, (double)rss / count,
+		       (double)vm / count, (double)commit / count);
+		for (int j = 0; j < count; ++j)
+			coro_wakeup(coros[j]);
+		struct coro *c;
+		while ((c = coro_sched_wait()) != NULL)
+			coro_delete(c);
+	}
+	free(coros);
+	coro_stack_pool_set_size(64);
+}
+
+enum {
+	BENCH_POLICY_BATCH_COUNT = 16,
+	BENCH_POLICY_ROUNDS = 1000,
+	/** Work between yields of a batch coroutine. */
+	BENCH_POLICY_SLICE_NS = 20000,
+};
+
+struct bench_policy_arg {
+	/** Latency-critical coroutine, woken by batch coroutine 0. */
+	struct coro *critical;
+	bool is_stopped;
+};
+
+static int
+bench_policy_critical_f(void *arg)
+{
+	struct bench_policy_arg *a = arg;
+	while (!a->is_stopped)
+		coro_suspend();
+	return 0;
+}
+
+static int
+bench_policy_batch_f(void *arg)
+{
+	struct bench_policy_arg *a = arg;
+	bool is_waker = a->critical != NULL;
+	for (int i = 0; i < BENCH_POLICY_ROUNDS; ++i) {
+		double start = bench_now_ns();
+		while (bench_now_ns() - start < BENCH_POLICY_SLICE_NS)
+			;
+		if (is_waker)
+			coro_wakeup(a->critical);
+		coro_yield();
+	}
+	if (is_waker) {
+		a->is_stopped = true;
+		coro_wakeup(a->critical);
+	}
+	return 0;
+}
+
+/**
+ * Batch coroutines do slices of CPU work between yields, one of
+ * them wakes up a latency-critical coroutine after each slice.
+ * Reported is how long the critical one waits in the ready queue
+ * under each policy, and the cost of a yield in the ping-pong of
+ * the 'yield' bench.
+ */
+static void
+bench_policy(void)
+{
+	const char *names[] = {"round-robin", "priority", "edf"};
+	enum coro_sched_policy policies[] = {
+		CORO_SCHED_ROUND_ROBIN, CORO_SCHED_PRIORITY, CORO_SCHED_EDF,
+	};
+	for (int i = 0; i < 3; ++i) {
+		coro_sched_init();
+		coro_sched_set_policy(policies[i]);
+		struct bench_policy_arg arg = {NULL, false};
+		struct coro_attr attr = {
+			.priority = 1,
+			.latency = BENCH_POLICY_SLICE_NS / 2,
+			.histograms = true,
+		};
+		arg.critical = coro_new_ex(bench_policy_critical_f, &arg,
+					   &attr);
+		struct bench_policy_arg other_arg = {NULL, false};
+		coro_new(bench_policy_batch_f, &arg);
+		for (int j = 1; j < BENCH_POLICY_BATCH_COUNT; ++j)
+			coro_new(bench_policy_batch_f, &other_arg);
+		struct coro *c;
+		struct coro_hist wait = {0};
+		while ((c = coro_sched_wait()) != NULL) {
+			if (c == arg.critical)
+				coro_histograms(c, &wait, NULL);
+			coro_delete(c);
+		}
+		printf("policy: %s, critical coroutine wait p50 %lld ns, "
+		       "p99 %lld ns, max %lld ns\n", names[i],
+		       coro_hist_percentile(&wait, 50),
+		       coro_hist_percentile(&wait, 99), wait.max);
+
+		int count = BENCH_YIELD_ITERATIONS;
+		coro_new(bench_yield_f, &count);
+		coro_new(bench_yield_f, &count);
+		double start = bench_now_ns();
+		long long switches = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			switches += coro_switch_count(c);
+			coro_delete(c);
+		}
+		printf("policy: %s, %.2f ns per coro_yield()\n", names[i],
+		       (bench_now_ns() - start) / switches);
+	}
+	coro_sched_init();
+}
+
+struct bench {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct bench benches[] = {
+	{"yield", bench_yield},
+	{"create", bench_create},
+	{"sched", bench_sched},
+	{"mt", bench_mt},
+	{"quantum", bench_quantum},
+	{"alloc", bench_alloc},
+	{"sleep", bench_sleep},
+	{"chan", bench_chan},
+	{"trace", bench_trace},
+	{"idle", bench_idle},
+	{"policy", bench_policy},
+};
+
+int
+main(int argc, char **argv)
+{
+	int count = sizeof(benches) / sizeof(benches[0]);
+	for (int i = 0; i < count; ++i) {
+		if (argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+			continue;
+		benches[i].run();
+	}
+	return 0;
+}
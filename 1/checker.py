@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -7,23 +8,58 @@ parser = argparse.ArgumentParser(description = "Check that a file contains "\
 					       "not decreasing sequence of "\
 					       "numbers")
 parser.add_argument('-f', type=str, required=True, help="file name")
+parser.add_argument('-t', type=str, default='text',
+		    choices=['text', 'raw', 'delta'],
+		    help='file format: text, little-endian int32 or varints '\
+			 'of the differences between neighbours')
 args = parser.parse_args()
 
 
-f = open(args.f, 'r')
+def read_text(data):
+	for word in data.split():
+		try:
+			yield int(word)
+		except ValueError:
+			pass
+
+
+def read_raw(data):
+	if len(data) % 4 != 0:
+		print('Error: the file is not a whole number of int32')
+		exit(1)
+	for v in struct.iter_unpack('<i', data):
+		yield v[0]
+
+
+def read_delta(data):
+	# LEB128 differences modulo 2^32, the first one from 0
+	value = 0
+	delta = 0
+	shift = 0
+	for byte in data:
+		delta |= (byte & 0x7f) << shift
+		shift += 7
+		if byte & 0x80:
+			continue
+		value = (value + delta) & 0xffffffff
+		yield value - (1 << 32) if value >= maxint else value
+		delta = 0
+		shift = 0
+	if shift != 0:
+		print('Error: the file ends inside a number')
+		exit(1)
+
+
+f = open(args.f, 'rb')
 data = f.read()
 f.close()
 
-data = data.split()
-prev_number = -(1 << 31 - 1)
-for i in range(0, len(data)):
-	try:
-		v = int(data[i])
-		if v < prev_number:
-			print('Error on numbers {} {}'.format(prev_number, v))
-			exit(1)
-		prev_number = v
-	except:
-		pass
+readers = {'text': read_text, 'raw': read_raw, 'delta': read_delta}
+prev_number = -maxint
+for v in readers[args.t](data):
+	if v < prev_number:
+		print('Error on numbers {} {}'.format(prev_number, v))
+		exit(1)
+	prev_number = v
 
 print('All is ok')
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "coro_chan.h"
+#include "libcoro.h"
+
+/**
+ * A coroutine blocked on a channel. Lives on the coroutine's
+ * stack while it waits.
+ */
+struct coro_chan_waiter {
+	struct coro *coro;
+	/** What to send, or what was received. */
+	void *msg;
+	/** True, when the other side has done the operation. */
+	bool is_done;
+	struct coro_chan_waiter *next;
+};
+
+/** FIFO of waiters. */
+struct coro_chan_waiters {
+	struct coro_chan_waiter *first, *last;
+};
+
+struct coro_chan {
+	/**
+	 * Protects everything. The waiters are woken up under the
+	 * lock, so a waiter can't leave before the wakeup is done.
+	 */
+	pthread_mutex_t lock;
+	/** Ring buffer of the messages. */
+	void **buf;
+	int capacity;
+	/** Index of the oldest message. */
+	int head;
+	int size;
+	/** Wait for room in the buffer. */
+	struct coro_chan_waiters senders;
+	/** Wait for a message. */
+	struct coro_chan_waiters receivers;
+	bool is_closed;
+};
+
+static void
+coro_chan_waiters_push(struct coro_chan_waiters *q,
+		       struct coro_chan_waiter *w)
+{
+	w->next = NULL;
+	if (q->last == NULL)
+		q->first = w;
+	else
+		q->last->next = w;
+	q->last = w;
+}
+
+static struct coro_chan_waiter *
+coro_chan_waiters_pop(struct coro_chan_waiters *q)
+{
+	struct coro_chan_waiter *w = q->first;
+	if (w == NULL)
+		return NULL;
+	q->first = w->next;
+	if (q->first == NULL)
+		q->last = NULL;
+	return w;
+}
+
+/** Remove a waiter from any place of the queue. */
+static void
+coro_chan_waiters_remove(struct coro_chan_waiters *q,
+			 struct coro_chan_waiter *w)
+{
+	struct coro_chan_waiter *prev = NULL;
+	struct coro_chan_waiter *it = q->first;
+	while (it != w) {
+		prev = it;
+		it = it->next;
+	}
+	if (prev == NULL)
+		q->first = w->next;
+	else
+		prev->next = w->next;
+	if (q->last == w)
+		q->last = prev;
+}
+
+/** Tell the waiter its operation is done, and let it run. */
+static void
+coro_chan_waiter_done(struct coro_chan_waiter *w)
+{
+	w->is_done = true;
+	coro_wakeup(w->coro);
+}
+
+/** Wake up all the waiters of the queue, without doing anything. */
+static void
+coro_chan_waiters_abort(struct coro_chan_waiters *q)
+{
+	struct coro_chan_waiter *w;
+	while ((w = coro_chan_waiters_pop(q)) != NULL)
+		coro_wakeup(w->coro);
+}
+
+/**
+ * Wait until the operation is done, the channel is closed, or the
+ * coroutine is cancelled. The lock is taken on entry and on
+ * return.
+ *
+ * @retval 0 Done.
+ * @retval -1 Not done, errno is set.
+ */
+static int
+coro_chan_wait(struct coro_chan *ch, struct coro_chan_waiters *q,
+	       struct coro_chan_waiter *w)
+{
+	coro_chan_waiters_push(q, w);
+	while (!w->is_done && !ch->is_closed) {
+		if (coro_is_cancelled()) {
+			coro_chan_waiters_remove(q, w);
+			errno = ECANCELED;
+			return -1;
+		}
+		pthread_mutex_unlock(&ch->lock);
+		coro_suspend();
+		pthread_mutex_lock(&ch->lock);
+	}
+	if (w->is_done)
+		return 0;
+	/* Closing removed all the waiters. */
+	errno = EPIPE;
+	return -1;
+}
+
+struct coro_chan *
+coro_chan_new(int capacity)
+{
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		return NULL;
+	if (capacity > 0) {
+		ch->buf = malloc(capacity * sizeof(ch->buf[0]));
+		if (ch->buf == NULL) {
+			free(ch);
+			return NULL;
+		}
+		ch->capacity = capacity;
+	}
+	pthread_mutex_init(&ch->lock, NULL);
+	return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	pthread_mutex_destroy(&ch->lock);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	pthread_mutex_lock(&ch->lock);
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	/* A waiting receiver means the buffer is empty. */
+	struct coro_chan_waiter *w = coro_chan_waiters_pop(&ch->receivers);
+	if (w != NULL) {
+		w->msg = msg;
+		coro_chan_waiter_done(w);
+		pthread_mutex_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->size < ch->capacity) {
+		ch->buf[(ch->head + ch->size) % ch->capacity] = msg;
+		++ch->size;
+		pthread_mutex_unlock(&ch->lock);
+		return 0;
+	}
+	struct coro_chan_waiter self = {coro_this(), msg, false, NULL};
+	int rc = coro_chan_wait(ch, &ch->senders, &self);
+	pthread_mutex_unlock(&ch->lock);
+	return rc;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	pthread_mutex_lock(&ch->lock);
+	if (ch->size > 0) {
+		*msg = ch->buf[ch->head];
+		ch->head = (ch->head + 1) % ch->capacity;
+		--ch->size;
+		/* The first blocked sender takes the freed slot. */
+		struct coro_chan_waiter *w =
+			coro_chan_waiters_pop(&ch->senders);
+		if (w != NULL) {
+			ch->buf[(ch->head + ch->size) % ch->capacity] = w->msg;
+			++ch->size;
+			coro_chan_waiter_done(w);
+		}
+		pthread_mutex_unlock(&ch->lock);
+		return 0;
+	}
+	/* Without a buffer the senders wait for a receiver. */
+	struct coro_chan_waiter *w = coro_chan_waiters_pop(&ch->senders);
+	if (w != NULL) {
+		*msg = w->msg;
+		coro_chan_waiter_done(w);
+		pthread_mutex_unlock(&ch->lock);
+		return 0;
+	}
+	if (ch->is_closed) {
+		pthread_mutex_unlock(&ch->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	struct coro_chan_waiter self = {coro_this(), NULL, false, NULL};
+	int rc = coro_chan_wait(ch, &ch->receivers, &self);
+	pthread_mutex_unlock(&ch->lock);
+	if (rc == 0)
+		*msg = self.msg;
+	return rc;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+	ch->is_closed = true;
+	coro_chan_waiters_abort(&ch->senders);
+	coro_chan_waiters_abort(&ch->receivers);
+	pthread_mutex_unlock(&ch->lock);
+}
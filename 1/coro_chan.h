@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * Bounded multi-producer multi-consumer channel of pointers
+ * between coroutines. A full or empty channel suspends the
+ * coroutine instead of spinning. Messages are passed as is, the
+ * channel never copies what they point at. The channel can be used
+ * by coroutines on different worker threads.
+ *
+ * The blocking calls should be made from coroutines - the
+ * scheduler context has nobody to switch to while it waits.
+ */
+
+struct coro_chan;
+
+/**
+ * Create a channel buffering up to @a capacity messages. With 0
+ * capacity each send waits for a receiver, and the other way
+ * round.
+ */
+struct coro_chan *
+coro_chan_new(int capacity);
+
+/** Free the channel. Nobody should be waiting on it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send a message, wait while the channel is full. When a receiver
+ * is waiting already, the message is handed over right to it,
+ * bypassing the buffer.
+ *
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, errno is EPIPE, or the
+ *     coroutine is cancelled while waiting, errno is ECANCELED.
+ *     The message is not delivered.
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message, wait while the channel is empty. Senders get
+ * the messages through in FIFO order.
+ *
+ * @retval 0 Success, the message is in @a msg.
+ * @retval -1 The channel is closed and empty, errno is EPIPE, or
+ *     the coroutine is cancelled while waiting, errno is
+ *     ECANCELED.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Close the channel. The buffered messages can still be received.
+ * The waiting senders fail, and so do the waiting receivers once
+ * the buffer is empty.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "coro_io.h"
+#include "libcoro.h"
+
+/**
+ * True, if the error means "try again later". Waits for the
+ * events in that case.
+ */
+static bool
+coro_io_would_block(int fd, int events)
+{
+	if (errno == EINTR)
+		return true;
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return false;
+	return coro_fd_wait(fd, events) == 0;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = read(fd, buf, size);
+		if (rc >= 0 || !coro_io_would_block(fd, CORO_FD_READ))
+			return rc;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	while (true) {
+		ssize_t rc = write(fd, buf, size);
+		if (rc >= 0 || !coro_io_would_block(fd, CORO_FD_WRITE))
+			return rc;
+	}
+}
+
+ssize_t
+coro_write_all(int fd, const void *buf, size_t size)
+{
+	const char *pos = buf;
+	size_t left = size;
+	while (left > 0) {
+		ssize_t rc = coro_write(fd, pos, left);
+		if (rc < 0)
+			return rc;
+		pos += rc;
+		left -= rc;
+	}
+	return size;
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	while (true) {
+		int rc = accept4(fd, addr, addrlen,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (rc >= 0 || !coro_io_would_block(fd, CORO_FD_READ))
+			return rc;
+	}
+}
+
+enum {
+	/** Reads in flight at once, more are done synchronously. */
+	CORO_AIO_QUEUE_SIZE = 64,
+	/** Helper threads at most, when io_uring is not used. */
+	CORO_AIO_THREAD_MAX = 4,
+	/**
+	 * How often a blocked waiter checks its read, in case the
+	 * completion is reaped by a poller on another thread.
+	 */
+	CORO_AIO_BLOCK_TIMEOUT_MS = 10,
+};
+
+/**
+ * The shared state of the asynchronous reads. Each completion
+ * signals the eventfd, which a waiting coroutine waits for in
+ * epoll.
+ */
+struct coro_aio_queue {
+	pthread_mutex_t lock;
+	/** Signaled on each completion. */
+	int event_fd;
+	enum coro_aio_backend backend;
+	/** io_uring descriptor, -1 if not available. */
+	int ring_fd;
+	/** Submission queue ring. */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/** Completion queue ring. */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Reads in flight, their count. */
+	struct coro_aio *pending;
+	int pending_count;
+	/** Reads completed by the threads, not reaped yet. */
+	struct coro_aio *completed;
+	/**
+	 * Reads not taken by a helper thread yet, in the order of
+	 * submission. They are pending as well.
+	 */
+	struct coro_aio *submitted[CORO_AIO_QUEUE_SIZE];
+	int submitted_head;
+	int submitted_count;
+	/** Signaled when a read is submitted to the threads. */
+	pthread_cond_t cond;
+	/** Helper threads started, and the ones with nothing to do. */
+	int thread_count;
+	int idle_count;
+	/** True, if a coroutine waits for the eventfd. */
+	bool has_poller;
+};
+
+static struct coro_aio_queue coro_aio_queue;
+
+static pthread_once_t coro_aio_once = PTHREAD_ONCE_INIT;
+
+/**
+ * True, if the ring supports IORING_OP_READ. It came in Linux 5.6
+ * together with the probe, older kernels fail the probe.
+ */
+static bool
+coro_aio_uring_can_read(int fd)
+{
+	struct {
+		struct io_uring_probe probe;
+		struct io_uring_probe_op ops[IORING_OP_READ + 1];
+	} p;
+	memset(&p, 0, sizeof(p));
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &p,
+		    IORING_OP_READ + 1) != 0)
+		return false;
+	return p.probe.ops_len > IORING_OP_READ &&
+	       (p.ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+/**
+ * Map the rings of a new io_uring. Returns false if it fails, or
+ * the kernel can't read with it.
+ */
+static bool
+coro_aio_uring_create(struct coro_aio_queue *q)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, CORO_AIO_QUEUE_SIZE, &p);
+	if (fd < 0)
+		return false;
+	if (!coro_aio_uring_can_read(fd)) {
+		close(fd);
+		return false;
+	}
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	char *cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED ||
+	    syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+		    &q->event_fd, 1) != 0) {
+		/* The mappings live as long as the process anyway. */
+		close(fd);
+		return false;
+	}
+	q->ring_fd = fd;
+	q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	q->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	q->sq_array = (unsigned *)(sq + p.sq_off.array);
+	q->sqes = sqes;
+	q->cq_head = (unsigned *)(cq + p.cq_off.head);
+	q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	q->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+static void
+coro_aio_init(void)
+{
+	struct coro_aio_queue *q = &coro_aio_queue;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	q->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	q->ring_fd = -1;
+	q->backend = CORO_AIO_THREADS;
+	if (q->event_fd >= 0 && coro_aio_uring_create(q))
+		q->backend = CORO_AIO_URING;
+}
+
+static inline struct coro_aio_queue *
+coro_aio_queue_get(void)
+{
+	pthread_once(&coro_aio_once, coro_aio_init);
+	return &coro_aio_queue;
+}
+
+/** Signal the eventfd, a poller wakes up. */
+static void
+coro_aio_signal(struct coro_aio_queue *q)
+{
+	uint64_t one = 1;
+	ssize_t rc = write(q->event_fd, &one, sizeof(one));
+	(void)rc;
+}
+
+/** Remove a read from the list of the ones in flight. */
+static void
+coro_aio_unlink(struct coro_aio_queue *q, struct coro_aio *req)
+{
+	if (req->prev != NULL)
+		req->prev->next = req->next;
+	else
+		q->pending = req->next;
+	if (req->next != NULL)
+		req->next->prev = req->prev;
+}
+
+/**
+ * Helper thread, when io_uring is not used. Takes the submitted
+ * reads one by one, lives as long as the process.
+ */
+static void *
+coro_aio_thread_f(void *arg)
+{
+	(void)arg;
+	struct coro_aio_queue *q = &coro_aio_queue;
+	while (true) {
+		pthread_mutex_lock(&q->lock);
+		q->idle_count++;
+		while (q->submitted_count == 0)
+			pthread_cond_wait(&q->cond, &q->lock);
+		q->idle_count--;
+		struct coro_aio *req = q->submitted[q->submitted_head];
+		q->submitted_head = (q->submitted_head + 1) %
+				    CORO_AIO_QUEUE_SIZE;
+		q->submitted_count--;
+		pthread_mutex_unlock(&q->lock);
+		ssize_t rc = pread(req->fd, req->buf, req->size,
+				   req->offset);
+		int save_errno = errno;
+		pthread_mutex_lock(&q->lock);
+		req->result = rc < 0 ? -save_errno : rc;
+		/* Only the poller's thread can wake the coroutines up. */
+		coro_aio_unlink(q, req);
+		req->next = q->completed;
+		q->completed = req;
+		pthread_mutex_unlock(&q->lock);
+		coro_aio_signal(q);
+	}
+	return NULL;
+}
+
+/**
+ * Give a read to the helper threads, start one more if all are
+ * busy. Under the lock. Returns false if there are no threads.
+ */
+static bool
+coro_aio_thread_submit(struct coro_aio_queue *q, struct coro_aio *req)
+{
+	if (q->idle_count <= q->submitted_count &&
+	    q->thread_count < CORO_AIO_THREAD_MAX) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, coro_aio_thread_f,
+				   NULL) == 0)
+			q->thread_count++;
+		pthread_attr_destroy(&attr);
+	}
+	if (q->thread_count == 0)
+		return false;
+	/* Not more than pending, so there is always room. */
+	int tail = (q->submitted_head + q->submitted_count) %
+		   CORO_AIO_QUEUE_SIZE;
+	q->submitted[tail] = req;
+	q->submitted_count++;
+	pthread_cond_signal(&q->cond);
+	return true;
+}
+
+/** Finish a read and wake its waiter up. Under the lock. */
+static void
+coro_aio_complete(struct coro_aio_queue *q, struct coro_aio *req,
+		  ssize_t result)
+{
+	req->result = result;
+	req->is_done = true;
+	q->pending_count--;
+	if (req->waiter != NULL)
+		coro_wakeup(req->waiter);
+}
+
+/** Collect all the completions. Under the lock. */
+static void
+coro_aio_reap(struct coro_aio_queue *q)
+{
+	while (q->completed != NULL) {
+		struct coro_aio *req = q->completed;
+		q->completed = req->next;
+		coro_aio_complete(q, req, req->result);
+	}
+	if (q->ring_fd < 0)
+		return;
+	unsigned head = *q->cq_head;
+	unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+		struct coro_aio *req = (struct coro_aio *)cqe->user_data;
+		coro_aio_unlink(q, req);
+		coro_aio_complete(q, req, cqe->res);
+	}
+	__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * The poller is leaving. Wake up somebody else waiting, it polls
+ * next. Under the lock.
+ */
+static void
+coro_aio_handoff(struct coro_aio_queue *q)
+{
+	struct coro_aio *lists[] = {q->pending, q->completed};
+	for (int i = 0; i < 2; ++i) {
+		for (struct coro_aio *r = lists[i]; r != NULL; r = r->next) {
+			if (r->waiter != NULL) {
+				coro_wakeup(r->waiter);
+				return;
+			}
+		}
+	}
+}
+
+void
+coro_aio_pread(struct coro_aio *req, int fd, void *buf, size_t size,
+	       off_t offset)
+{
+	struct coro_aio_queue *q = coro_aio_queue_get();
+	req->fd = fd;
+	req->buf = buf;
+	req->size = size;
+	req->offset = offset;
+	req->is_done = false;
+	req->waiter = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->pending_count == CORO_AIO_QUEUE_SIZE) {
+		pthread_mutex_unlock(&q->lock);
+		ssize_t rc = pread(fd, buf, size, offset);
+		req->result = rc < 0 ? -errno : rc;
+		req->is_done = true;
+		return;
+	}
+	q->pending_count++;
+	req->prev = NULL;
+	req->next = q->pending;
+	if (q->pending != NULL)
+		q->pending->prev = req;
+	q->pending = req;
+	if (q->backend == CORO_AIO_URING) {
+		unsigned tail = *q->sq_tail;
+		unsigned index = tail & *q->sq_mask;
+		struct io_uring_sqe *sqe = &q->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = size;
+		sqe->off = offset;
+		sqe->user_data = (uintptr_t)req;
+		q->sq_array[index] = index;
+		__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		if (syscall(__NR_io_uring_enter, q->ring_fd, 1, 0, 0, NULL,
+			    0) == 1) {
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		/* Not consumed by the kernel, take it back. */
+		__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+	} else if (coro_aio_thread_submit(q, req)) {
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+	/* Could not submit, read right here. */
+	coro_aio_unlink(q, req);
+	q->pending_count--;
+	pthread_mutex_unlock(&q->lock);
+	ssize_t rc = pread(fd, buf, size, offset);
+	req->result = rc < 0 ? -errno : rc;
+	req->is_done = true;
+}
+
+/**
+ * Wait for a read outside of a coroutine, where nothing can be
+ * suspended. Blocks the thread and reaps the completions itself,
+ * even when a coroutine is the poller. Without worker threads
+ * that one can't run until the wait is over. Under the lock.
+ */
+static void
+coro_aio_wait_blocking(struct coro_aio_queue *q, struct coro_aio *req)
+{
+	bool has_taken_signal = false;
+	while (!req->is_done) {
+		pthread_mutex_unlock(&q->lock);
+		struct pollfd pfd = {q->event_fd, POLLIN, 0};
+		poll(&pfd, 1, CORO_AIO_BLOCK_TIMEOUT_MS);
+		uint64_t count;
+		if (read(q->event_fd, &count, sizeof(count)) > 0)
+			has_taken_signal = true;
+		pthread_mutex_lock(&q->lock);
+		coro_aio_reap(q);
+	}
+	/*
+	 * The poller coroutine could miss its completions, signal
+	 * again. Only once, or this waiter would take it back.
+	 */
+	if (has_taken_signal && q->has_poller)
+		coro_aio_signal(q);
+}
+
+ssize_t
+coro_aio_wait(struct coro_aio *req)
+{
+	struct coro_aio_queue *q = &coro_aio_queue;
+	pthread_mutex_lock(&q->lock);
+	if (!coro_can_suspend())
+		coro_aio_wait_blocking(q, req);
+	while (!req->is_done) {
+		if (q->has_poller) {
+			/* The poller wakes this one up when done. */
+			req->waiter = coro_this();
+			pthread_mutex_unlock(&q->lock);
+			coro_suspend();
+			pthread_mutex_lock(&q->lock);
+			req->waiter = NULL;
+			continue;
+		}
+		q->has_poller = true;
+		pthread_mutex_unlock(&q->lock);
+		if (coro_fd_wait(q->event_fd, CORO_FD_READ) != 0) {
+			/*
+			 * Cancelled, but the buffer is still being
+			 * read to. Block the thread.
+			 */
+			struct pollfd pfd = {q->event_fd, POLLIN, 0};
+			poll(&pfd, 1, -1);
+		}
+		uint64_t count;
+		ssize_t rc = read(q->event_fd, &count, sizeof(count));
+		(void)rc;
+		pthread_mutex_lock(&q->lock);
+		coro_aio_reap(q);
+		q->has_poller = false;
+		if (req->is_done)
+			coro_aio_handoff(q);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if (req->result < 0) {
+		errno = -req->result;
+		return -1;
+	}
+	return req->result;
+}
+
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset)
+{
+	struct coro_aio req;
+	coro_aio_pread(&req, fd, buf, size, offset);
+	return coro_aio_wait(&req);
+}
+
+enum coro_aio_backend
+coro_aio_backend(void)
+{
+	struct coro_aio_queue *q = coro_aio_queue_get();
+	pthread_mutex_lock(&q->lock);
+	enum coro_aio_backend backend = q->backend;
+	pthread_mutex_unlock(&q->lock);
+	return backend;
+}
+
+void
+coro_aio_set_backend(enum coro_aio_backend backend)
+{
+	struct coro_aio_queue *q = coro_aio_queue_get();
+	pthread_mutex_lock(&q->lock);
+	if (backend == CORO_AIO_THREADS || q->ring_fd >= 0)
+		q->backend = backend;
+	pthread_mutex_unlock(&q->lock);
+}
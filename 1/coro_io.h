@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct coro;
+
+/**
+ * Blocking-style I/O for coroutines. The descriptors must be
+ * non-blocking. When an operation would block, the current
+ * coroutine is suspended until the descriptor is ready, and other
+ * coroutines keep running meanwhile. The return values and errno
+ * are the same as of the corresponding system calls.
+ */
+
+/** Read at most @a size bytes, wait if there is nothing yet. */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Write at most @a size bytes, wait if nothing fits yet. */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/** Write all the @a size bytes, waiting as long as needed. */
+ssize_t
+coro_write_all(int fd, const void *buf, size_t size);
+
+/**
+ * Accept a new connection, wait if there are none. The returned
+ * descriptor is non-blocking already.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Asynchronous reads of regular files, which epoll can't wait
+ * for. A read is submitted to io_uring, or to a helper thread
+ * when the kernel does not allow io_uring, and the coroutine can
+ * do something else until it waits for the result. While it
+ * waits, the other coroutines run. The descriptor does not need
+ * to be non-blocking. The reads can be made from coroutines on
+ * different worker threads.
+ */
+
+/** Where the reads go. */
+enum coro_aio_backend {
+	CORO_AIO_URING,
+	CORO_AIO_THREADS,
+};
+
+/**
+ * A read in flight. Owned by the caller, and must stay alive,
+ * together with the buffer, until coro_aio_wait() returns.
+ */
+struct coro_aio {
+	int fd;
+	void *buf;
+	size_t size;
+	off_t offset;
+	/** Bytes read, or -errno. Valid when done. */
+	ssize_t result;
+	bool is_done;
+	/** The coroutine suspended in coro_aio_wait(), or NULL. */
+	struct coro *waiter;
+	/** In the list of the reads in flight, or of the completed ones. */
+	struct coro_aio *prev;
+	struct coro_aio *next;
+};
+
+/**
+ * Start reading at most @a size bytes at @a offset. When the
+ * queue is full, the read is done right away, synchronously.
+ *
+ * The read can be waited for from a coroutine, or from the
+ * scheduler context. There coro_aio_wait() blocks the thread, so
+ * without worker threads no coroutine runs until the read is
+ * done. Other threads can wait only when there are workers, the
+ * same as for coro_wakeup().
+ */
+void
+coro_aio_pread(struct coro_aio *req, int fd, void *buf, size_t size,
+	       off_t offset);
+
+/**
+ * Wait until the read is done. One of the waiting coroutines
+ * waits for the completions in epoll and wakes up the others.
+ *
+ * @return The same as of pread().
+ */
+ssize_t
+coro_aio_wait(struct coro_aio *req);
+
+/** Read like pread(), other coroutines run meanwhile. */
+ssize_t
+coro_pread(int fd, void *buf, size_t size, off_t offset);
+
+/** The backend the next reads go to. */
+enum coro_aio_backend
+coro_aio_backend(void);
+
+/**
+ * Send the next reads to the @a backend. io_uring is the
+ * default, and the threads are used when it is not available.
+ */
+void
+coro_aio_set_backend(enum coro_aio_backend backend);
@@ -1,16 +1,32 @@
 import random
 import argparse
+import struct
 
-maxint = 1 << 31
+# the sorter reads int32
+maxint = (1 << 31) - 1
 
 parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('-t', type=str, default='text', choices=['text', 'raw'],
+		    help='file format: text or little-endian int32')
 args = parser.parse_args()
 random.seed()
 
 
+if args.t == 'raw':
+	f = open(args.f, 'wb')
+	# by blocks, so that a big file does not take a list of all the numbers
+	left = args.c
+	while left > 0:
+		count = min(left, 1 << 16)
+		f.write(struct.pack('<{}i'.format(count),
+				    *[random.randint(0, args.m) for i in range(count)]))
+		left -= count
+	f.close()
+	exit(0)
+
 f = open(args.f, 'w')
 
 for i in range(0, args.c):
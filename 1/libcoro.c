@@ -1,258 +1,2648 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 #include "libcoro.h"
 
 #define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
 
+#if defined(__x86_64__) && !defined(CORO_USE_UCONTEXT)
+
+/**
+ * Saved execution context of a coroutine. A cooperative switch
+ * always happens at a function call, so only the registers the
+ * ABI asks a callee to preserve need to survive it. They are
+ * pushed onto the coroutine's own stack, and the context itself
+ * is just the stack pointer.
+ */
+struct coro_ctx {
+	void *sp;
+};
+
+/**
+ * Save the current context into @a from and resume @a to. From
+ * the point of view of the caller the function returns when
+ * somebody switches back to @a from.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to);
+
+#ifdef __APPLE__
+#define CORO_ASM_SYM(name) "_" #name
+#else
+#define CORO_ASM_SYM(name) #name
+#endif
+
+/*
+ * Layout of a saved context on the stack, from the saved stack
+ * pointer up: MXCSR and x87 control word (8 bytes with padding),
+ * r15, r14, r13, r12, rbx, rbp, return address. The SSE and x87
+ * control words are callee-saved too according to SysV ABI.
+ */
+#define CORO_ASM_SAVE							\
+	"	pushq %rbp\n"						\
+	"	pushq %rbx\n"						\
+	"	pushq %r12\n"						\
+	"	pushq %r13\n"						\
+	"	pushq %r14\n"						\
+	"	pushq %r15\n"						\
+	"	subq $8, %rsp\n"					\
+	"	stmxcsr (%rsp)\n"					\
+	"	fnstcw 4(%rsp)\n"					\
+	"	movq %rsp, (%rdi)\n"
+
+__asm__(
+	"	.text\n"
+	"	.globl " CORO_ASM_SYM(coro_ctx_switch) "\n"
+	"	.p2align 4\n"
+	CORO_ASM_SYM(coro_ctx_switch) ":\n"
+	CORO_ASM_SAVE
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+);
+
+enum {
+	/** Default MXCSR: all SSE exceptions masked. */
+	CORO_CTX_MXCSR = 0x1f80,
+	/** Default x87 control word: extended precision, masked. */
+	CORO_CTX_FPUCW = 0x037f,
+};
+
+/**
+ * Build on the stack a frame looking exactly like one saved by
+ * coro_ctx_switch(), so the first switch to @a ctx "returns"
+ * into @a entry. No syscalls are needed for that.
+ */
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)top;
+	/*
+	 * Fake return address of the entry, which never returns.
+	 * After 'ret' pops the entry address the stack pointer is
+	 * 8 mod 16, as if the entry was called.
+	 */
+	*--sp = 0;
+	*--sp = (uint64_t)(uintptr_t)entry;
+	/* rbp, rbx, r12, r13, r14, r15. */
+	for (int i = 0; i < 6; ++i)
+		*--sp = 0;
+	*--sp = (uint64_t)CORO_CTX_FPUCW << 32 | CORO_CTX_MXCSR;
+	ctx->sp = sp;
+}
+
+#else /* portable ucontext fallback */
+
+#include <ucontext.h>
+
+/**
+ * Saved execution context of a coroutine. Swapcontext() saves
+ * more than needed, including the signal mask, but works
+ * anywhere.
+ */
+struct coro_ctx {
+	ucontext_t uc;
+};
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+}
+
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	/*
+	 * Getcontext() is a syscall here (it saves the signal
+	 * mask), but the fallback is slow in any case.
+	 */
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, entry, 0);
+}
+
+#endif
+
+enum {
+	/** How many coroutine-local keys can be created. */
+	CORO_KEY_MAX = 16,
+};
+
+/**
+ * A chunk of a coroutine arena. The memory is given out right
+ * after the header, which keeps it aligned by 16.
+ */
+struct coro_arena_chunk {
+	/** Neighbours in the arena, in the allocation order. */
+	struct coro_arena_chunk *prev, *next;
+	/** Size of the memory after the header. */
+	size_t size;
+	/** How much of it is allocated. */
+	size_t used;
+};
+
 /** Main coroutine structure, its context. */
 struct coro {
 	/** A value, returned by func. */
 	int ret;
 	/** Stack, used by the coroutine. */
 	void *stack;
+	/** Usable size of the stack, without the guard page. */
+	size_t stack_size;
+	/** True, if there is a guard page below the stack. */
+	bool has_stack_guard;
 	/** An argument for the function func. */
 	void *func_arg;
 	/** A function to call as a coroutine. */
 	coro_f func;
 	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+	struct coro_ctx ctx;
 	/** True, if the coroutine has finished. */
 	bool is_finished;
+	/**
+	 * Suspension state, enum coro_wake_state. Atomic, because
+	 * the wakeup can come from another thread.
+	 */
+	int wake_state;
 	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
+	/** Unique number of the coroutine, 0 is a scheduler context. */
+	int id;
+	/**
+	 * Time spent running, in coro_ticks(), without the current
+	 * slice.
+	 */
+	long long run_time;
+	/** When the coroutine was switched to last time, in coro_ticks(). */
+	long long slice_start;
+	/** Time slice for coro_yield_if_expired(). 0 - unlimited. */
+	long long quantum;
+	/** When the time slice started, kept only with a quantum. */
+	long long quantum_start;
+	/** Calls of coro_yield_if_expired() until the next clock read. */
+	int quantum_check_countdown;
+	/** Values of the coroutine-local keys. */
+	void *locals[CORO_KEY_MAX];
+	/**
+	 * Chunk of the arena the allocations go to. The previous
+	 * ones are full, the next ones are free and kept for reuse.
+	 */
+	struct coro_arena_chunk *arena;
+	/** When a sleep or a suspension with timeout ends. */
+	long long deadline;
+	/** Timers which have the coroutine, NULL if none. */
+	struct coro_timers *timers;
+	/** I/O whose descriptor the coroutine waits for, NULL if none. */
+	struct coro_io *io;
+	/** Index in the timer heap. */
+	int timer_pos;
+	/** Priority for CORO_SCHED_PRIORITY. */
+	int priority;
+	/** Relative deadline for CORO_SCHED_EDF, 0 if none. */
+	long long latency;
+	/** When the coroutine became ready last time. */
+	long long ready_time;
+	/** Absolute deadline in the EDF ready queue. */
+	long long ready_deadline;
+	/** Order of becoming ready, for EDF ties. */
+	long long ready_seq;
+	/** Wait and run time histograms, NULL if not collected. */
+	struct coro_hists *hists;
+	/** Group the coroutine belongs to, NULL if none. */
+	struct coro_group *group;
+	/** True, if the coroutine was asked to stop. Atomic. */
+	bool is_cancelled;
+	/** Scheduler which ran the coroutine last time. */
+	struct coro_sched *sched;
+	/**
+	 * Links in a scheduler queue - ready or finished. A
+	 * running coroutine is not in any queue.
+	 */
 	struct coro *next, *prev;
 };
 
+enum coro_wake_state {
+	/** Running or ready to run. */
+	CORO_WAKE_NONE,
+	/** Suspended, not in any queue. */
+	CORO_WAKE_SUSPENDED,
+	/**
+	 * Woken up while not suspended yet. The next suspension
+	 * ends right away.
+	 */
+	CORO_WAKE_SIGNALED,
+};
+
+/** Intrusive FIFO of coroutines, linked via next/prev. */
+struct coro_queue {
+	struct coro *first, *last;
+};
+
+/**
+ * Ready coroutines of a scheduler. Which part is used depends on
+ * the scheduling policy.
+ */
+struct coro_ready {
+	/** FIFO per priority. Round-robin uses only the first one. */
+	struct coro_queue queues[CORO_PRIORITY_MAX + 1];
+	/** Bit i is set, if queues[i] is not empty. */
+	unsigned mask;
+	/** EDF min-heap by deadline. */
+	struct coro **heap;
+	int heap_size;
+	int heap_capacity;
+	/** Pushes to the heap, to keep FIFO on equal deadlines. */
+	long long seq;
+};
+
+/** Wait and run time histograms of a coroutine. */
+struct coro_hists {
+	struct coro_hist wait;
+	struct coro_hist run;
+};
+
+/** Coroutines waiting for one file descriptor. */
+struct coro_fd_waiters {
+	/** Waits for the descriptor to become readable. */
+	struct coro *reader;
+	/** Waits for the descriptor to become writable. */
+	struct coro *writer;
+	/** True, if the descriptor was added to epoll. */
+	bool is_registered;
+};
+
+/**
+ * Readiness of file descriptors, used by the scheduler when no
+ * coroutine can run, and from time to time by coro_yield().
+ */
+struct coro_io {
+	/** Epoll descriptor, created on the first wait. */
+	int epoll_fd;
+	/** Waiters indexed by file descriptor. */
+	struct coro_fd_waiters *fds;
+	/** Size of the fds array. */
+	int fd_capacity;
+	/**
+	 * How many coroutines wait for descriptors now. Changed
+	 * under the lock, but is peeked by the owner without it.
+	 */
+	int waiter_count;
+	/**
+	 * Protects the waiters when there are worker threads. A
+	 * coroutine can be woken up on another thread and removes
+	 * itself from here.
+	 */
+	pthread_mutex_t lock;
+};
+
+/**
+ * Coroutines sleeping until a deadline. A binary min-heap by
+ * deadline, so the nearest one is always on top, and adding or
+ * removing a timer is O(log n).
+ */
+struct coro_timers {
+	struct coro **heap;
+	/**
+	 * Number of timers. Changed under the lock, but is peeked
+	 * by the owner without it.
+	 */
+	int size;
+	int capacity;
+	/**
+	 * Protects the heap when there are worker threads. A
+	 * coroutine can be woken up on another thread and removes
+	 * its timer from here itself.
+	 */
+	pthread_mutex_t lock;
+};
+
+/**
+ * What the next context should do with the previous coroutine
+ * right after a switch. Until the switch is done the previous
+ * coroutine's registers are not saved, and it can't be seen by
+ * other threads.
+ */
+enum coro_switch_action {
+	CORO_SWITCH_NONE,
+	/** Put into the ready queue. */
+	CORO_SWITCH_READY,
+	/** Mark as suspended. */
+	CORO_SWITCH_SUSPEND,
+	/** Hand over to coro_sched_wait(). */
+	CORO_SWITCH_FINISH,
+};
+
+#ifdef CORO_TRACE
+
+/** Why a coroutine stopped running, for tracing. */
+enum coro_trace_reason {
+	/** The scheduler context switched to a coroutine. */
+	CORO_TRACE_RUN,
+	CORO_TRACE_YIELD,
+	CORO_TRACE_SUSPEND,
+	CORO_TRACE_FINISH,
+};
+
+static const char *const coro_trace_reason_strs[] = {
+	"run", "yield", "suspend", "finish",
+};
+
+/** One switch of a scheduler. */
+struct coro_trace_event {
+	long long time;
+	int from;
+	int to;
+	enum coro_trace_reason reason;
+};
+
+/**
+ * Ring buffer of the recent switches of a scheduler. Only the
+ * scheduler's thread writes there, so no locks are needed. The
+ * oldest events are overwritten.
+ */
+struct coro_trace {
+	/** True, if the switches are recorded. Atomic. */
+	bool is_enabled;
+	struct coro_trace_event *events;
+	/** Capacity - 1, the capacity is a power of 2. */
+	size_t mask;
+	/** Events recorded since the start. */
+	size_t pos;
+};
+
+#endif /* CORO_TRACE */
+
+/**
+ * Scheduler of one thread. Its main coroutine is the thread's own
+ * context - it catches finished coroutines and runs when nobody
+ * else can.
+ */
+struct coro_sched {
+	struct coro main;
+	/**
+	 * True, if in that moment the scheduler is waiting for a
+	 * coroutine finish.
+	 */
+	bool is_waiting;
+	/** Coroutines ready to run, ordered by the policy. */
+	struct coro_ready ready;
+	/**
+	 * Size of the ready queue, with worker threads only. Atomic,
+	 * to be peeked by thieves without locking.
+	 */
+	int ready_size;
+	/**
+	 * Finished coroutines, not returned by coro_sched_wait()
+	 * yet. Without worker threads only.
+	 */
+	struct coro_queue finished;
+	/** Protects the ready queue when there are worker threads. */
+	pthread_mutex_t lock;
+	/** The coroutine switched from, and what to do with it. */
+	struct coro *switch_from;
+	enum coro_switch_action switch_action;
+	struct coro_io io;
+	struct coro_timers timers;
+	/**
+	 * Yields since the last check for ready descriptors and
+	 * expired timers.
+	 */
+	int yield_count;
+	/** Worker thread running this scheduler, if it is a worker. */
+	pthread_t thread;
+#ifdef CORO_TRACE
+	struct coro_trace trace;
+#endif
+};
+
+/**
+ * Coroutines joined together. They are not returned by
+ * coro_sched_wait(), the group waits for them and deletes them.
+ */
+struct coro_group {
+	/**
+	 * Protects everything, when there are worker threads. The
+	 * children are woken up under the lock, so none of them can
+	 * be deleted meanwhile.
+	 */
+	pthread_mutex_t lock;
+	/** Signaled, when the last child finishes. */
+	pthread_cond_t cond;
+	/** All the children, finished or not. */
+	struct coro **children;
+	int child_count;
+	int child_capacity;
+	/** Children not finished yet. */
+	int live_count;
+	/** The first non-zero status of a child. */
+	int error;
+	bool is_cancelled;
+	/** A coroutine waiting in coro_group_join(). */
+	struct coro *joiner;
+};
+
+/** Scheduler of the thread, which called coro_sched_init(). */
+static struct coro_sched coro_sched_main;
+/** Scheduler of the current thread. NULL, if it has none. */
+static __thread struct coro_sched *coro_sched_ptr = NULL;
+/** Which coroutine works at this moment in this thread. */
+static __thread struct coro *coro_this_ptr = NULL;
+
+/**
+ * State of the M:N mode, when coroutines run on worker threads.
+ * Each worker has its own scheduler and ready queue. Idle workers
+ * steal ready coroutines from the others.
+ */
+static struct coro_mt {
+	/** True, if the worker threads are running. */
+	bool is_enabled;
+	struct coro_sched *workers;
+	int worker_count;
+	/** Next worker to get a coroutine created outside of them. */
+	int next_worker;
+	/** Protects everything below, except for the atomics. */
+	pthread_mutex_t lock;
+	/** Idle workers sleep here. */
+	pthread_cond_t idle_cond;
+	/** Coroutine finishes are signaled here. */
+	pthread_cond_t finished_cond;
+	/** Finished coroutines, not returned by coro_sched_wait(). */
+	struct coro_queue finished;
+	/** Coroutines not returned by coro_sched_wait() yet. */
+	int live_count;
+	/** True, if the workers should exit. */
+	bool is_stopping;
+	/** Coroutines in all the ready queues. Atomic. */
+	int ready_count;
+	/** Workers sleeping on idle_cond. Atomic. */
+	int idle_count;
+} coro_mt = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+	.finished_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Lock a mutex, but only when there are worker threads. */
+static inline void
+coro_mt_lock(pthread_mutex_t *lock)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_lock(lock);
+}
+
+static inline void
+coro_mt_unlock(pthread_mutex_t *lock)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_unlock(lock);
+}
+
+/** Append a coroutine to the end of a queue. */
+static inline void
+coro_queue_push(struct coro_queue *q, struct coro *c)
+{
+	c->next = NULL;
+	c->prev = q->last;
+	if (q->last != NULL)
+		q->last->next = c;
+	else
+		q->first = c;
+	q->last = c;
+}
+
+/** Remove a coroutine from any place of a queue. */
+static inline void
+coro_queue_remove(struct coro_queue *q, struct coro *c)
+{
+	struct coro *prev = c->prev, *next = c->next;
+	if (prev != NULL)
+		prev->next = next;
+	else
+		q->first = next;
+	if (next != NULL)
+		next->prev = prev;
+	else
+		q->last = prev;
+	c->next = c->prev = NULL;
+}
+
+/** Take the first coroutine from a queue. NULL, if empty. */
+static inline struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+	struct coro *c = q->first;
+	if (c != NULL)
+		coro_queue_remove(q, c);
+	return c;
+}
+
+/**
+ * Monotonic time in nanoseconds. Clock_gettime() does not enter
+ * the kernel for CLOCK_MONOTONIC on Linux, it is read via vDSO.
+ */
+static inline long long
+coro_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Cheap time for the run time accounting on each switch. The time
+ * stamp counter where there is one, it costs a fraction of
+ * coro_clock(). Only differences on one thread are meaningful.
+ */
+static inline long long
+coro_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return coro_clock();
+#endif
+}
+
+/**
+ * The first reading of both clocks. The tick rate is measured
+ * from it when ticks are converted.
+ */
+static struct {
+	long long ticks;
+	long long ns;
+} coro_ticks_base;
+
+static pthread_once_t coro_ticks_once = PTHREAD_ONCE_INIT;
+
+static void
+coro_ticks_base_init(void)
+{
+	coro_ticks_base.ns = coro_clock();
+	coro_ticks_base.ticks = coro_ticks();
+}
+
+/** Convert a coro_ticks() difference to nanoseconds. */
+static long long
+coro_ticks_to_ns(long long ticks)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	long long ns = coro_clock() - coro_ticks_base.ns;
+	long long total = coro_ticks() - coro_ticks_base.ticks;
+	if (total <= 0 || ns <= 0)
+		return 0;
+	return (long long)((double)ticks * ns / total);
+#else
+	return ticks;
+#endif
+}
+
+/**
+ * Scheduling policy - in which order the ready coroutines run.
+ * All the methods are called with the scheduler's ready queue
+ * lock taken, if there are worker threads.
+ */
+struct coro_policy {
+	/** Add a coroutine, which has become ready. */
+	void
+	(*push)(struct coro_ready *r, struct coro *c);
+	/** Take the coroutine to run next. NULL, if empty. */
+	struct coro *
+	(*pop)(struct coro_ready *r);
+	/**
+	 * Take a coroutine to run on another scheduler, preferably
+	 * not the most urgent one.
+	 */
+	struct coro *
+	(*steal)(struct coro_ready *r);
+	/**
+	 * True, if a yielding coroutine is more urgent than all the
+	 * ready ones, and should keep running. NULL means never.
+	 */
+	bool
+	(*is_first)(struct coro_ready *r, struct coro *c);
+};
+
+static void
+coro_rr_push(struct coro_ready *r, struct coro *c)
+{
+	coro_queue_push(&r->queues[0], c);
+}
+
+static struct coro *
+coro_rr_pop(struct coro_ready *r)
+{
+	return coro_queue_pop(&r->queues[0]);
+}
+
+static struct coro *
+coro_rr_steal(struct coro_ready *r)
+{
+	/* The owner takes from the head, the tail is less contended. */
+	struct coro *c = r->queues[0].last;
+	if (c != NULL)
+		coro_queue_remove(&r->queues[0], c);
+	return c;
+}
+
+static const struct coro_policy coro_policy_rr = {
+	.push = coro_rr_push,
+	.pop = coro_rr_pop,
+	.steal = coro_rr_steal,
+	.is_first = NULL,
+};
+
+static void
+coro_prio_push(struct coro_ready *r, struct coro *c)
+{
+	coro_queue_push(&r->queues[c->priority], c);
+	r->mask |= 1u << c->priority;
+}
+
+/** Take the last or the first coroutine of a priority queue. */
+static struct coro *
+coro_prio_take(struct coro_ready *r, int priority, bool is_last)
+{
+	struct coro_queue *q = &r->queues[priority];
+	struct coro *c = is_last ? q->last : q->first;
+	coro_queue_remove(q, c);
+	if (q->first == NULL)
+		r->mask &= ~(1u << priority);
+	return c;
+}
+
+static struct coro *
+coro_prio_pop(struct coro_ready *r)
+{
+	if (r->mask == 0)
+		return NULL;
+	return coro_prio_take(r, 31 - __builtin_clz(r->mask), false);
+}
+
+static struct coro *
+coro_prio_steal(struct coro_ready *r)
+{
+	if (r->mask == 0)
+		return NULL;
+	return coro_prio_take(r, __builtin_ctz(r->mask), true);
+}
+
+static bool
+coro_prio_is_first(struct coro_ready *r, struct coro *c)
+{
+	return r->mask == 0 || c->priority > 31 - __builtin_clz(r->mask);
+}
+
+static const struct coro_policy coro_policy_prio = {
+	.push = coro_prio_push,
+	.pop = coro_prio_pop,
+	.steal = coro_prio_steal,
+	.is_first = coro_prio_is_first,
+};
+
+/** True, if @a a should run before @a b by EDF. */
+static inline bool
+coro_edf_less(const struct coro *a, const struct coro *b)
+{
+	if (a->ready_deadline != b->ready_deadline)
+		return a->ready_deadline < b->ready_deadline;
+	return a->ready_seq < b->ready_seq;
+}
+
+static void
+coro_edf_push(struct coro_ready *r, struct coro *c)
+{
+	if (r->heap_size == r->heap_capacity) {
+		int capacity = r->heap_capacity == 0 ? 64 :
+			       r->heap_capacity * 2;
+		struct coro **heap =
+			realloc(r->heap, capacity * sizeof(heap[0]));
+		if (heap == NULL)
+			handle_error();
+		r->heap = heap;
+		r->heap_capacity = capacity;
+	}
+	c->ready_deadline = c->latency != 0 ? c->ready_time + c->latency :
+			    INT64_MAX;
+	c->ready_seq = r->seq++;
+	int pos = r->heap_size++;
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (!coro_edf_less(c, r->heap[parent]))
+			break;
+		r->heap[pos] = r->heap[parent];
+		pos = parent;
+	}
+	r->heap[pos] = c;
+}
+
+static struct coro *
+coro_edf_pop(struct coro_ready *r)
+{
+	if (r->heap_size == 0)
+		return NULL;
+	struct coro *res = r->heap[0];
+	struct coro *c = r->heap[--r->heap_size];
+	int pos = 0;
+	while (true) {
+		int child = 2 * pos + 1;
+		if (child >= r->heap_size)
+			break;
+		if (child + 1 < r->heap_size &&
+		    coro_edf_less(r->heap[child + 1], r->heap[child]))
+			++child;
+		if (!coro_edf_less(r->heap[child], c))
+			break;
+		r->heap[pos] = r->heap[child];
+		pos = child;
+	}
+	r->heap[pos] = c;
+	return res;
+}
+
+static struct coro *
+coro_edf_steal(struct coro_ready *r)
+{
+	/* A leaf, so one of the latest deadlines. */
+	if (r->heap_size == 0)
+		return NULL;
+	return r->heap[--r->heap_size];
+}
+
+static bool
+coro_edf_is_first(struct coro_ready *r, struct coro *c)
+{
+	if (r->heap_size == 0)
+		return true;
+	if (c->latency == 0)
+		return false;
+	return coro_clock() + c->latency < r->heap[0]->ready_deadline;
+}
+
+static const struct coro_policy coro_policy_edf = {
+	.push = coro_edf_push,
+	.pop = coro_edf_pop,
+	.steal = coro_edf_steal,
+	.is_first = coro_edf_is_first,
+};
+
+/** Policy of all the schedulers. */
+static const struct coro_policy *coro_policy_ptr = &coro_policy_rr;
+
+static inline const struct coro_policy *
+coro_policy(void)
+{
+	return __atomic_load_n(&coro_policy_ptr, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add a coroutine to the ready queue. The lock should be taken,
+ * if there are worker threads.
+ */
+static inline void
+coro_ready_add(struct coro_sched *s, struct coro *c)
+{
+	if (c->hists != NULL || c->latency != 0)
+		c->ready_time = coro_clock();
+	coro_policy()->push(&s->ready, c);
+}
+
+/** Make a coroutine ready to run on the given scheduler. */
+static void
+coro_ready_push(struct coro_sched *s, struct coro *c)
+{
+	/* Only the scheduler's own thread can get here then. */
+	if (!coro_mt.is_enabled) {
+		coro_ready_add(s, c);
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	coro_ready_add(s, c);
+	__atomic_add_fetch(&s->ready_size, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+	__atomic_add_fetch(&coro_mt.ready_count, 1, __ATOMIC_SEQ_CST);
+	/*
+	 * Somebody could sleep with nothing to do. Wake one up, it
+	 * will steal the coroutine if the owner is busy.
+	 */
+	if (__atomic_load_n(&coro_mt.idle_count, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&coro_mt.lock);
+		pthread_cond_signal(&coro_mt.idle_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+	}
+}
+
+/** Take the next ready coroutine of the scheduler. */
+static inline struct coro *
+coro_ready_pop(struct coro_sched *s)
+{
+	if (!coro_mt.is_enabled)
+		return coro_policy()->pop(&s->ready);
+	pthread_mutex_lock(&s->lock);
+	struct coro *c = coro_policy()->pop(&s->ready);
+	if (c != NULL)
+		__atomic_sub_fetch(&s->ready_size, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_mt.ready_count, 1, __ATOMIC_SEQ_CST);
+	return c;
+}
+
+/**
+ * True, if the policy prefers the yielding coroutine to all the
+ * ready ones.
+ */
+static inline bool
+coro_ready_is_first(struct coro_sched *s, struct coro *c)
+{
+	const struct coro_policy *policy = coro_policy();
+	if (policy->is_first == NULL)
+		return false;
+	coro_mt_lock(&s->lock);
+	bool res = policy->is_first(&s->ready, c);
+	coro_mt_unlock(&s->lock);
+	return res;
+}
+
+enum {
+	/** Stack size when no attributes are given. */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** How many released stacks are kept by default. */
+	CORO_STACK_POOL_SIZE_DEFAULT = 64,
+};
+
+/**
+ * Header of a released stack waiting for reuse in the pool. It is
+ * stored right in the stack memory, which is not used anyway. It
+ * is at the top, where the stack starts, so no page is faulted in
+ * only to keep the header.
+ */
+struct coro_stack_free {
+	/** The lowest address of the stack. */
+	void *stack;
+	/** Usable size of the stack. */
+	size_t size;
+	/** True, if there is a guard page below the stack. */
+	bool has_guard;
+	/** Next stack in the pool. */
+	struct coro_stack_free *next;
+};
+
+/**
+ * Cache of released stacks. A new coroutine takes a stack of a
+ * matching size from here, if there is one, without any
+ * syscalls and without faulting the pages in again.
+ */
+static struct coro_stack_pool {
+	/** Most recently released stacks go first. */
+	struct coro_stack_free *head;
+	/** How many stacks are in the list. */
+	int count;
+	/** Max number of stacks to keep. */
+	int max_count;
+	/** Statistics. */
+	long long hits;
+	long long misses;
+	/** Protects the pool when there are worker threads. */
+	pthread_mutex_t lock;
+} coro_stack_pool = {
+	.max_count = CORO_STACK_POOL_SIZE_DEFAULT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/** System page size, used for guard pages and rounding. */
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/** Unmap a stack together with its guard page, if any. */
+static void
+coro_stack_unmap(void *stack, size_t size, bool has_guard)
+{
+	size_t guard_size = has_guard ? coro_page_size() : 0;
+	if (munmap((char *)stack - guard_size, size + guard_size) != 0)
+		handle_error();
+}
+
+/**
+ * Get a stack of the given usable size, which must be page
+ * aligned. Below the stack is a PROT_NONE guard page, if asked, so
+ * an overflow crashes right away instead of corrupting memory.
+ * The guard splits the mapping in two, and the stacks without it
+ * are merged by the kernel with their neighbours.
+ *
+ * The stack is not charged against the commit limit, and the
+ * kernel gives it physical pages only when they are touched. So a
+ * big stack grows lazily and costs only address space until it is
+ * used, and an idle coroutine holds about one page.
+ */
+static void *
+coro_stack_new(size_t size, bool has_guard)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	coro_mt_lock(&pool->lock);
+	struct coro_stack_free **prev = &pool->head;
+	for (struct coro_stack_free *s = pool->head; s != NULL;
+	     prev = &s->next, s = s->next) {
+		if (s->size != size || s->has_guard != has_guard)
+			continue;
+		*prev = s->next;
+		--pool->count;
+		++pool->hits;
+		coro_mt_unlock(&pool->lock);
+		return s->stack;
+	}
+	++pool->misses;
+	coro_mt_unlock(&pool->lock);
+	size_t guard_size = has_guard ? coro_page_size() : 0;
+	char *map = mmap(NULL, size + guard_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK |
+			 MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (has_guard && mprotect(map, guard_size, PROT_NONE) != 0)
+		handle_error();
+	return map + guard_size;
+}
+
+/** Return a stack into the pool, or unmap if it is full. */
+static void
+coro_stack_delete(void *stack, size_t size, bool has_guard)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	coro_mt_lock(&pool->lock);
+	if (pool->count >= pool->max_count) {
+		coro_mt_unlock(&pool->lock);
+		coro_stack_unmap(stack, size, has_guard);
+		return;
+	}
+	struct coro_stack_free *s =
+		(struct coro_stack_free *)((char *)stack + size) - 1;
+	s->stack = stack;
+	s->size = size;
+	s->has_guard = has_guard;
+	s->next = pool->head;
+	pool->head = s;
+	++pool->count;
+	coro_mt_unlock(&pool->lock);
+}
+
+void
+coro_stack_pool_set_size(int max_count)
+{
+	struct coro_stack_pool *pool = &coro_stack_pool;
+	coro_mt_lock(&pool->lock);
+	pool->max_count = max_count < 0 ? 0 : max_count;
+	while (pool->count > pool->max_count) {
+		struct coro_stack_free *s = pool->head;
+		pool->head = s->next;
+		--pool->count;
+		coro_stack_unmap(s->stack, s->size, s->has_guard);
+	}
+	coro_mt_unlock(&pool->lock);
+}
+
+void
+coro_stack_pool_stat(struct coro_stack_pool_stat *stat)
+{
+	coro_mt_lock(&coro_stack_pool.lock);
+	stat->hits = coro_stack_pool.hits;
+	stat->misses = coro_stack_pool.misses;
+	stat->count = coro_stack_pool.count;
+	coro_mt_unlock(&coro_stack_pool.lock);
+}
+
+int
+coro_status(const struct coro *c)
+{
+	return c->ret;
+}
+
+long long
+coro_switch_count(const struct coro *c)
+{
+	return c->switch_count;
+}
+
+long long
+coro_run_time(const struct coro *c)
+{
+	long long res = c->run_time;
+	if (c == coro_this_ptr)
+		res += coro_ticks() - c->slice_start;
+	return coro_ticks_to_ns(res);
+}
+
+void
+coro_set_quantum(struct coro *c, long long quantum)
+{
+	c->quantum = quantum < 0 ? 0 : quantum;
+	c->quantum_check_countdown = 0;
+	if (c->quantum != 0)
+		c->quantum_start = coro_clock();
+}
+
+bool
+coro_is_finished(const struct coro *c)
+{
+	return c->is_finished;
+}
+
+enum {
+	/** Size of the first chunk of a coroutine arena. */
+	CORO_ARENA_CHUNK_SIZE = 64 * 1024,
+	/** Alignment of all the arena allocations. */
+	CORO_ARENA_ALIGN = 16,
+};
+
+static inline char *
+coro_arena_chunk_data(struct coro_arena_chunk *chunk)
+{
+	return (char *)(chunk + 1);
+}
+
+/**
+ * Make the current arena chunk fit @a size bytes. A spare chunk is
+ * reused, when it is big enough. Otherwise the spares are freed,
+ * and a new chunk is allocated, twice bigger than the previous
+ * one, so the number of chunks stays logarithmic.
+ */
+static struct coro_arena_chunk *
+coro_arena_grow(struct coro *c, size_t size)
+{
+	struct coro_arena_chunk *prev = c->arena;
+	struct coro_arena_chunk *next = prev != NULL ? prev->next : NULL;
+	if (next != NULL && next->size >= size) {
+		next->used = 0;
+		c->arena = next;
+		return next;
+	}
+	while (next != NULL) {
+		struct coro_arena_chunk *tmp = next->next;
+		free(next);
+		next = tmp;
+	}
+	size_t chunk_size = CORO_ARENA_CHUNK_SIZE;
+	if (prev != NULL && prev->size * 2 > chunk_size)
+		chunk_size = prev->size * 2;
+	if (size > chunk_size)
+		chunk_size = size;
+	struct coro_arena_chunk *chunk =
+		malloc(sizeof(*chunk) + chunk_size);
+	if (chunk == NULL)
+		handle_error();
+	chunk->prev = prev;
+	chunk->next = NULL;
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	if (prev != NULL)
+		prev->next = chunk;
+	c->arena = chunk;
+	return chunk;
+}
+
+void *
+coro_alloc(size_t size)
+{
+	struct coro *c = coro_this_ptr;
+	size = (size + CORO_ARENA_ALIGN - 1) & ~(size_t)(CORO_ARENA_ALIGN - 1);
+	struct coro_arena_chunk *chunk = c->arena;
+	if (chunk == NULL || chunk->size - chunk->used < size)
+		chunk = coro_arena_grow(c, size);
+	void *res = coro_arena_chunk_data(chunk) + chunk->used;
+	chunk->used += size;
+	return res;
+}
+
+void
+coro_arena_free(void *ptr)
+{
+	struct coro *c = coro_this_ptr;
+	struct coro_arena_chunk *chunk = c->arena;
+	if (chunk == NULL)
+		return;
+	char *pos = ptr;
+	while (true) {
+		char *data = coro_arena_chunk_data(chunk);
+		if (pos >= data && pos <= data + chunk->used) {
+			chunk->used = pos - data;
+			break;
+		}
+		chunk->used = 0;
+		if (chunk->prev == NULL) {
+			if (ptr != NULL) {
+				printf("Critical error - the memory is not "
+				       "from the coroutine arena!\n");
+				exit(-1);
+			}
+			break;
+		}
+		chunk = chunk->prev;
+	}
+	c->arena = chunk;
+}
+
+/** Destructors of the coroutine-local keys. */
+static void (*coro_key_destructors[CORO_KEY_MAX])(void *);
+/** How many keys are created. */
+static int coro_key_count;
+
+int
+coro_key_create(void (*destructor)(void *))
+{
+	int key = __atomic_fetch_add(&coro_key_count, 1, __ATOMIC_RELAXED);
+	if (key >= CORO_KEY_MAX) {
+		__atomic_sub_fetch(&coro_key_count, 1, __ATOMIC_RELAXED);
+		errno = EAGAIN;
+		return -1;
+	}
+	coro_key_destructors[key] = destructor;
+	return key;
+}
+
+void
+coro_key_set(int key, void *value)
+{
+	coro_this_ptr->locals[key] = value;
+}
+
+void *
+coro_key_get(int key)
+{
+	return coro_this_ptr->locals[key];
+}
+
+/**
+ * Call the destructors of the coroutine-local values and free
+ * the whole arena.
+ */
+static void
+coro_locals_destroy(struct coro *c)
+{
+	int count = __atomic_load_n(&coro_key_count, __ATOMIC_RELAXED);
+	if (count > CORO_KEY_MAX)
+		count = CORO_KEY_MAX;
+	for (int i = 0; i < count; ++i) {
+		void *value = c->locals[i];
+		if (value != NULL && coro_key_destructors[i] != NULL)
+			coro_key_destructors[i](value);
+		c->locals[i] = NULL;
+	}
+	struct coro_arena_chunk *chunk = c->arena;
+	while (chunk != NULL && chunk->prev != NULL)
+		chunk = chunk->prev;
+	while (chunk != NULL) {
+		struct coro_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	c->arena = NULL;
+}
+
+void
+coro_set_priority(struct coro *c, int priority)
+{
+	if (priority < 0)
+		priority = 0;
+	else if (priority > CORO_PRIORITY_MAX)
+		priority = CORO_PRIORITY_MAX;
+	c->priority = priority;
+}
+
+void
+coro_set_latency(struct coro *c, long long latency)
+{
+	c->latency = latency < 0 ? 0 : latency;
+}
+
+int
+coro_histograms(const struct coro *c, struct coro_hist *wait,
+		struct coro_hist *run)
+{
+	if (c->hists == NULL)
+		return -1;
+	if (wait != NULL)
+		*wait = c->hists->wait;
+	if (run != NULL)
+		*run = c->hists->run;
+	return 0;
+}
+
+long long
+coro_hist_percentile(const struct coro_hist *h, double percentile)
+{
+	long long need = (long long)(h->count * percentile / 100);
+	long long sum = 0;
+	for (int i = 0; i < CORO_HIST_BUCKET_COUNT; ++i) {
+		sum += h->counts[i];
+		if (sum > need) {
+			long long bound = (2LL << i) - 1;
+			return bound < h->max ? bound : h->max;
+		}
+	}
+	return h->max;
+}
+
+void
+coro_delete(struct coro *c)
+{
+	free(c->hists);
+	coro_locals_destroy(c);
+	coro_stack_delete(c->stack, c->stack_size, c->has_stack_guard);
+	free(c);
+}
+
+enum {
+	/** Max events taken from epoll at once. */
+	CORO_IO_EVENT_BATCH = 64,
+	/**
+	 * Once per that many yields ready descriptors and expired
+	 * timers are checked, even though there are other runnable
+	 * coroutines.
+	 */
+	CORO_IO_POLL_INTERVAL = 64,
+	/**
+	 * Coro_yield_if_expired() reads the clock once per that
+	 * many calls.
+	 */
+	CORO_QUANTUM_CHECK_INTERVAL = 16,
+	/**
+	 * An idle worker with descriptor or timer waiters can't
+	 * sleep on the condition variable, so it polls with this
+	 * timeout, in nanoseconds, to notice new ready coroutines.
+	 */
+	CORO_MT_IDLE_TIMEOUT = 1000 * 1000,
+};
+
+/** Reset the I/O state of a scheduler, before the first use. */
+static void
+coro_io_create(struct coro_io *io)
+{
+	memset(io, 0, sizeof(*io));
+	io->epoll_fd = -1;
+	pthread_mutex_init(&io->lock, NULL);
+}
+
+/** Free all the I/O resources of a scheduler. */
+static void
+coro_io_destroy(struct coro_io *io)
+{
+	if (io->epoll_fd >= 0)
+		close(io->epoll_fd);
+	free(io->fds);
+	pthread_mutex_destroy(&io->lock);
+}
+
+static inline void
+coro_io_lock(struct coro_io *io)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_lock(&io->lock);
+}
+
+static inline void
+coro_io_unlock(struct coro_io *io)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_unlock(&io->lock);
+}
+
+static inline int
+coro_io_waiter_count(struct coro_io *io)
+{
+	return __atomic_load_n(&io->waiter_count, __ATOMIC_RELAXED);
+}
+
+/** Add or remove waiters. The lock should be taken. */
+static inline void
+coro_io_count(struct coro_io *io, int delta)
+{
+	__atomic_store_n(&io->waiter_count, io->waiter_count + delta,
+			 __ATOMIC_RELAXED);
+}
+
+/** Make sure the descriptor has a waiters slot and epoll exists. */
+static int
+coro_io_reserve(struct coro_io *io, int fd)
+{
+	if (io->epoll_fd < 0) {
+		io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (io->epoll_fd < 0)
+			return -1;
+	}
+	if (fd < io->fd_capacity)
+		return 0;
+	int capacity = io->fd_capacity == 0 ? 64 : io->fd_capacity;
+	while (capacity <= fd)
+		capacity *= 2;
+	struct coro_fd_waiters *fds =
+		realloc(io->fds, capacity * sizeof(fds[0]));
+	if (fds == NULL)
+		return -1;
+	memset(fds + io->fd_capacity, 0,
+	       (capacity - io->fd_capacity) * sizeof(fds[0]));
+	io->fds = fds;
+	io->fd_capacity = capacity;
+	return 0;
+}
+
+/**
+ * Subscribe for the events the descriptor's waiters need. The
+ * subscription is one-shot, so nothing is reported for a
+ * descriptor nobody waits for. A closed descriptor disappears from
+ * epoll by itself, so its number can be registered again.
+ */
+static int
+coro_io_arm(struct coro_io *io, int fd)
+{
+	struct coro_fd_waiters *w = &io->fds[fd];
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLONESHOT;
+	if (w->reader != NULL)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if (w->writer != NULL)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+	int op = w->is_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(io->epoll_fd, op, fd, &ev) != 0) {
+		if (errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else
+			return -1;
+		if (epoll_ctl(io->epoll_fd, op, fd, &ev) != 0)
+			return -1;
+	}
+	w->is_registered = true;
+	return 0;
+}
+
+/** Wake up a descriptor waiter, if it is there. Under the lock. */
+static inline void
+coro_io_wakeup(struct coro_io *io, struct coro **waiter)
+{
+	struct coro *c = *waiter;
+	if (c == NULL)
+		return;
+	*waiter = NULL;
+	coro_io_count(io, -1);
+	/*
+	 * Under the lock, so the coroutine can't be woken up by
+	 * somebody else, finish and be deleted meanwhile.
+	 */
+	coro_wakeup(c);
+}
+
+/**
+ * Stop waiting for the descriptor without a wakeup. Under the
+ * lock.
+ */
+static void
+coro_io_remove(struct coro_io *io, int fd, struct coro *c)
+{
+	struct coro_fd_waiters *w = &io->fds[fd];
+	if (w->reader == c) {
+		w->reader = NULL;
+		coro_io_count(io, -1);
+	}
+	if (w->writer == c) {
+		w->writer = NULL;
+		coro_io_count(io, -1);
+	}
+}
+
+/**
+ * Wake up coroutines whose descriptors are ready. Timeout is in
+ * milliseconds, -1 to block until anything is ready.
+ */
+static void
+coro_io_poll(struct coro_io *io, int timeout)
+{
+	struct epoll_event events[CORO_IO_EVENT_BATCH];
+	int count = epoll_wait(io->epoll_fd, events, CORO_IO_EVENT_BATCH,
+			       timeout);
+	if (count < 0) {
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	coro_io_lock(io);
+	for (int i = 0; i < count; ++i) {
+		int fd = events[i].data.fd;
+		uint32_t e = events[i].events;
+		struct coro_fd_waiters *w = &io->fds[fd];
+		if ((e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) != 0)
+			coro_io_wakeup(io, &w->reader);
+		if ((e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0)
+			coro_io_wakeup(io, &w->writer);
+		/* One-shot disabled the descriptor, still needed. */
+		if ((w->reader != NULL || w->writer != NULL) &&
+		    coro_io_arm(io, fd) != 0)
+			handle_error();
+	}
+	coro_io_unlock(io);
+}
+
+int
+coro_fd_wait(int fd, int events)
+{
+	struct coro_sched *s = coro_sched_ptr;
+	struct coro *c = coro_this_ptr;
+	if (c == &s->main) {
+		/* Nobody to switch to, just block. */
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = 0;
+		if ((events & CORO_FD_READ) != 0)
+			pfd.events |= POLLIN;
+		if ((events & CORO_FD_WRITE) != 0)
+			pfd.events |= POLLOUT;
+		while (poll(&pfd, 1, -1) < 0) {
+			if (errno != EINTR)
+				return -1;
+		}
+		return 0;
+	}
+	if (coro_is_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
+	struct coro_io *io = &s->io;
+	coro_io_lock(io);
+	if (coro_io_reserve(io, fd) != 0) {
+		coro_io_unlock(io);
+		return -1;
+	}
+	struct coro_fd_waiters *w = &io->fds[fd];
+	if (((events & CORO_FD_READ) != 0 && w->reader != NULL &&
+	     w->reader != c) ||
+	    ((events & CORO_FD_WRITE) != 0 && w->writer != NULL &&
+	     w->writer != c)) {
+		coro_io_unlock(io);
+		errno = EBUSY;
+		return -1;
+	}
+	if ((events & CORO_FD_READ) != 0 && w->reader == NULL) {
+		w->reader = c;
+		coro_io_count(io, 1);
+	}
+	if ((events & CORO_FD_WRITE) != 0 && w->writer == NULL) {
+		w->writer = c;
+		coro_io_count(io, 1);
+	}
+	if (coro_io_arm(io, fd) != 0) {
+		int save_errno = errno;
+		coro_io_remove(io, fd, c);
+		coro_io_unlock(io);
+		errno = save_errno;
+		return -1;
+	}
+	c->io = io;
+	coro_io_unlock(io);
+	coro_suspend();
+	/*
+	 * Could be woken up by somebody else before the descriptor
+	 * got ready. Then stop waiting, the caller will retry. The
+	 * coroutine could move to another thread since then, but
+	 * the waiter stays in the old scheduler.
+	 */
+	io = c->io;
+	coro_io_lock(io);
+	coro_io_remove(io, fd, c);
+	c->io = NULL;
+	coro_io_unlock(io);
+	if (coro_is_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
+	return 0;
+}
+
+static inline void
+coro_timers_lock(struct coro_timers *t)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_lock(&t->lock);
+}
+
+static inline void
+coro_timers_unlock(struct coro_timers *t)
+{
+	if (coro_mt.is_enabled)
+		pthread_mutex_unlock(&t->lock);
+}
+
+static void
+coro_timers_create(struct coro_timers *t)
+{
+	t->heap = NULL;
+	t->size = 0;
+	t->capacity = 0;
+	pthread_mutex_init(&t->lock, NULL);
+}
+
+static void
+coro_timers_destroy(struct coro_timers *t)
+{
+	free(t->heap);
+	pthread_mutex_destroy(&t->lock);
+}
+
+static inline int
+coro_timers_size(struct coro_timers *t)
+{
+	return __atomic_load_n(&t->size, __ATOMIC_RELAXED);
+}
+
+/** Put the coroutine to the heap position and update its index. */
+static inline void
+coro_timers_place(struct coro_timers *t, int pos, struct coro *c)
+{
+	t->heap[pos] = c;
+	c->timer_pos = pos;
+}
+
+static void
+coro_timers_sift_up(struct coro_timers *t, int pos)
+{
+	struct coro *c = t->heap[pos];
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (t->heap[parent]->deadline <= c->deadline)
+			break;
+		coro_timers_place(t, pos, t->heap[parent]);
+		pos = parent;
+	}
+	coro_timers_place(t, pos, c);
+}
+
+static void
+coro_timers_sift_down(struct coro_timers *t, int pos)
+{
+	struct coro *c = t->heap[pos];
+	while (true) {
+		int child = 2 * pos + 1;
+		if (child >= t->size)
+			break;
+		if (child + 1 < t->size &&
+		    t->heap[child + 1]->deadline < t->heap[child]->deadline)
+			++child;
+		if (c->deadline <= t->heap[child]->deadline)
+			break;
+		coro_timers_place(t, pos, t->heap[child]);
+		pos = child;
+	}
+	coro_timers_place(t, pos, c);
+}
+
+/** Add a timer of the coroutine. The lock should be taken. */
+static void
+coro_timers_add(struct coro_timers *t, struct coro *c,
+		long long deadline)
+{
+	if (t->size == t->capacity) {
+		int capacity = t->capacity == 0 ? 64 : t->capacity * 2;
+		struct coro **heap =
+			realloc(t->heap, capacity * sizeof(heap[0]));
+		if (heap == NULL)
+			handle_error();
+		t->heap = heap;
+		t->capacity = capacity;
+	}
+	c->deadline = deadline;
+	c->timers = t;
+	__atomic_store_n(&t->size, t->size + 1, __ATOMIC_RELAXED);
+	coro_timers_place(t, t->size - 1, c);
+	coro_timers_sift_up(t, t->size - 1);
+}
+
+/** Remove a timer of the coroutine. The lock should be taken. */
+static void
+coro_timers_remove(struct coro_timers *t, struct coro *c)
+{
+	int pos = c->timer_pos;
+	c->timers = NULL;
+	__atomic_store_n(&t->size, t->size - 1, __ATOMIC_RELAXED);
+	if (pos == t->size)
+		return;
+	coro_timers_place(t, pos, t->heap[t->size]);
+	if (pos > 0 && t->heap[(pos - 1) / 2]->deadline > t->heap[pos]->deadline)
+		coro_timers_sift_up(t, pos);
+	else
+		coro_timers_sift_down(t, pos);
+}
+
+/** Wake up the coroutines whose deadline has come. */
+static void
+coro_timers_run(struct coro_timers *t)
+{
+	if (coro_timers_size(t) == 0)
+		return;
+	long long now = coro_clock();
+	coro_timers_lock(t);
+	while (t->size > 0 && t->heap[0]->deadline <= now) {
+		struct coro *c = t->heap[0];
+		coro_timers_remove(t, c);
+		/*
+		 * Under the lock, so the coroutine can't be woken up
+		 * by somebody else, finish and be deleted meanwhile.
+		 */
+		coro_wakeup(c);
+	}
+	coro_timers_unlock(t);
+}
+
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
+ * Nanoseconds until the nearest deadline, 0 if it has come, -1 if
+ * there are no timers.
  */
-static struct coro coro_sched;
+static long long
+coro_timers_timeout(struct coro_timers *t)
+{
+	if (coro_timers_size(t) == 0)
+		return -1;
+	coro_timers_lock(t);
+	long long res = -1;
+	if (t->size > 0) {
+		res = t->heap[0]->deadline - coro_clock();
+		if (res < 0)
+			res = 0;
+	}
+	coro_timers_unlock(t);
+	return res;
+}
+
 /**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Check for ready descriptors and expired timers without blocking,
+ * when there are other runnable coroutines.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+static void
+coro_sched_poll(struct coro_sched *s)
+{
+	s->yield_count = 0;
+	if (coro_io_waiter_count(&s->io) > 0)
+		coro_io_poll(&s->io, 0);
+	coro_timers_run(&s->timers);
+}
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * Block until a descriptor is ready or the nearest timer expires,
+ * but no longer than @a max_timeout nanoseconds, -1 for no limit.
+ * Then wake up whoever is ready.
  */
-static sigjmp_buf start_point;
-
-/** Add a new coroutine to the beginning of the list. */
 static void
-coro_list_add(struct coro *c)
+coro_sched_idle(struct coro_sched *s, long long max_timeout)
 {
-	c->next = coro_list;
-	c->prev = NULL;
-	if (coro_list != NULL)
-		coro_list->prev = c;
-	coro_list = c;
+	s->yield_count = 0;
+	long long timeout = coro_timers_timeout(&s->timers);
+	if (max_timeout >= 0 && (timeout < 0 || timeout > max_timeout))
+		timeout = max_timeout;
+	if (coro_io_waiter_count(&s->io) > 0) {
+		/* Round up, to not wake up before the deadline. */
+		int timeout_ms = timeout < 0 ? -1 :
+				 (int)((timeout + 999999) / 1000000);
+		coro_io_poll(&s->io, timeout_ms);
+	} else if (timeout > 0) {
+		struct timespec ts;
+		ts.tv_sec = timeout / 1000000000;
+		ts.tv_nsec = timeout % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+	coro_timers_run(&s->timers);
 }
 
-/** Remove a coroutine from the list. */
+/**
+ * Ask the children to stop and wake up the suspended ones. The
+ * group lock should be taken.
+ */
 static void
-coro_list_delete(struct coro *c)
+coro_group_cancel_locked(struct coro_group *g)
 {
-	struct coro *prev = c->prev, *next = c->next;
-	if (prev != NULL)
-		prev->next = next;
-	if (next != NULL)
-		next->prev = prev;
-	if (prev == NULL)
-		coro_list = next;
+	g->is_cancelled = true;
+	for (int i = 0; i < g->child_count; ++i) {
+		struct coro *c = g->children[i];
+		if (__atomic_exchange_n(&c->is_cancelled, true,
+					__ATOMIC_SEQ_CST))
+			continue;
+		coro_wakeup(c);
+	}
 }
 
-int
-coro_status(const struct coro *c)
+/**
+ * Account a finished child in its group. The first error cancels
+ * the other children.
+ */
+static void
+coro_group_finish(struct coro *c)
 {
-	return c->ret;
+	struct coro_group *g = c->group;
+	coro_mt_lock(&g->lock);
+	if (c->ret != 0 && g->error == 0) {
+		g->error = c->ret;
+		coro_group_cancel_locked(g);
+	}
+	if (--g->live_count == 0) {
+		if (g->joiner != NULL)
+			coro_wakeup(g->joiner);
+		if (coro_mt.is_enabled)
+			pthread_cond_broadcast(&g->cond);
+	}
+	coro_mt_unlock(&g->lock);
+	if (coro_mt.is_enabled) {
+		pthread_mutex_lock(&coro_mt.lock);
+		--coro_mt.live_count;
+		/* Wait_mt() could wait for the last coroutine. */
+		pthread_cond_signal(&coro_mt.finished_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+	}
 }
 
-long long
-coro_switch_count(const struct coro *c)
+/**
+ * Finish a switch on the new context: do what the previous
+ * coroutine asked for. Not inlined, because the thread could be
+ * different after the switch, and thread-local variables should
+ * be read anew.
+ */
+static __attribute__((noinline)) void
+coro_switch_done(void)
 {
-	return c->switch_count;
+	struct coro_sched *s = coro_sched_ptr;
+	enum coro_switch_action action = s->switch_action;
+	if (action == CORO_SWITCH_NONE)
+		return;
+	struct coro *prev = s->switch_from;
+	s->switch_action = CORO_SWITCH_NONE;
+	switch (action) {
+	case CORO_SWITCH_NONE:
+		break;
+	case CORO_SWITCH_READY:
+		coro_ready_push(s, prev);
+		break;
+	case CORO_SWITCH_SUSPEND: {
+		int expected = CORO_WAKE_NONE;
+		if (__atomic_compare_exchange_n(&prev->wake_state, &expected,
+						CORO_WAKE_SUSPENDED, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			break;
+		/* Woken up before managed to fall asleep. */
+		__atomic_store_n(&prev->wake_state, CORO_WAKE_NONE,
+				 __ATOMIC_SEQ_CST);
+		coro_ready_push(s, prev);
+		break;
+	}
+	case CORO_SWITCH_FINISH:
+		if (prev->group != NULL) {
+			coro_group_finish(prev);
+			break;
+		}
+		if (!coro_mt.is_enabled) {
+			coro_queue_push(&s->finished, prev);
+			break;
+		}
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_queue_push(&coro_mt.finished, prev);
+		pthread_cond_signal(&coro_mt.finished_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+		break;
+	}
 }
 
-bool
-coro_is_finished(const struct coro *c)
+#ifdef CORO_TRACE
+
+/** Record a switch of the scheduler, if tracing is on. */
+static inline void
+coro_trace_switch(struct coro_sched *s, struct coro *from,
+		  struct coro *to, enum coro_switch_action action)
 {
-	return c->is_finished;
+	struct coro_trace *t = &s->trace;
+	if (!__atomic_load_n(&t->is_enabled, __ATOMIC_ACQUIRE))
+		return;
+	struct coro_trace_event *e = &t->events[t->pos++ & t->mask];
+	e->time = coro_clock();
+	e->from = from->id;
+	e->to = to->id;
+	if (from == &s->main)
+		e->reason = CORO_TRACE_RUN;
+	else if (action == CORO_SWITCH_SUSPEND)
+		e->reason = CORO_TRACE_SUSPEND;
+	else if (action == CORO_SWITCH_FINISH)
+		e->reason = CORO_TRACE_FINISH;
+	else
+		e->reason = CORO_TRACE_YIELD;
 }
 
-void
-coro_delete(struct coro *c)
+#endif /* CORO_TRACE */
+
+static inline void
+coro_hist_add(struct coro_hist *h, long long value)
 {
-	free(c->stack);
-	free(c);
+	int i = value <= 1 ? 0 : 63 - __builtin_clzll(value);
+	if (i >= CORO_HIST_BUCKET_COUNT)
+		i = CORO_HIST_BUCKET_COUNT - 1;
+	++h->counts[i];
+	++h->count;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
 }
 
 /** Switch the current coroutine to an arbitrary one. */
 static void
-coro_yield_to(struct coro *to)
+coro_yield_to(struct coro *to, enum coro_switch_action action)
 {
+	struct coro_sched *s = coro_sched_ptr;
 	struct coro *from = coro_this_ptr;
-	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	coro_this_ptr = from;
+	/* The final switch of a coroutine is not counted. */
+	if (action != CORO_SWITCH_FINISH)
+		++from->switch_count;
+	/* The clock is read only for the ones who asked for it. */
+	long long now = coro_ticks();
+	if (from->hists != NULL) {
+		coro_hist_add(&from->hists->run,
+			      coro_ticks_to_ns(now - from->slice_start));
+	}
+	if (to->hists != NULL)
+		coro_hist_add(&to->hists->wait, coro_clock() - to->ready_time);
+	from->run_time += now - from->slice_start;
+	to->slice_start = now;
+	if (to->quantum != 0)
+		to->quantum_start = coro_clock();
+#ifdef CORO_TRACE
+	coro_trace_switch(s, from, to, action);
+#endif
+	s->switch_from = from;
+	s->switch_action = action;
+	to->sched = s;
+	coro_this_ptr = to;
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	coro_switch_done();
 }
 
 void
 coro_yield(void)
 {
+	struct coro_sched *s = coro_sched_ptr;
 	struct coro *from = coro_this_ptr;
-	struct coro *to = from->next;
+	/* The scheduler runs coroutines only from coro_sched_wait(). */
+	if (from == &s->main)
+		return;
+	/* Do not let busy coroutines starve the I/O and timer waiters. */
+	if ((coro_io_waiter_count(&s->io) > 0 ||
+	     coro_timers_size(&s->timers) > 0) &&
+	    ++s->yield_count >= CORO_IO_POLL_INTERVAL)
+		coro_sched_poll(s);
+	/*
+	 * Give way to the next runnable coroutine, unless the policy
+	 * prefers the caller. When the caller is the only one, there
+	 * is nothing to switch to.
+	 */
+	if (coro_ready_is_first(s, from))
+		return;
+	struct coro *to = coro_ready_pop(s);
 	if (to == NULL)
-		coro_yield_to(&coro_sched);
-	else
-		coro_yield_to(to);
+		return;
+	/*
+	 * Without other threads nobody can see the coroutine in the
+	 * queue until the switch is done.
+	 */
+	if (!coro_mt.is_enabled) {
+		coro_ready_add(s, from);
+		coro_yield_to(to, CORO_SWITCH_NONE);
+		return;
+	}
+	coro_yield_to(to, CORO_SWITCH_READY);
+}
+
+bool
+coro_yield_if_expired(void)
+{
+	struct coro *c = coro_this_ptr;
+	if (c->quantum == 0 || --c->quantum_check_countdown > 0)
+		return false;
+	c->quantum_check_countdown = CORO_QUANTUM_CHECK_INTERVAL;
+	long long now = coro_clock();
+	if (now - c->quantum_start < c->quantum)
+		return false;
+	long long switch_count = c->switch_count;
+	coro_yield();
+	if (c->switch_count != switch_count)
+		return true;
+	/* Nobody else to run. Start a new slice. */
+	c->quantum_start = now;
+	return false;
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_sched *s = coro_sched_ptr;
+	struct coro *from = coro_this_ptr;
+	if (from == &s->main)
+		return;
+	/*
+	 * When nobody else can run, the scheduler gets the control
+	 * back. A wakeup could come from there.
+	 */
+	struct coro *to = coro_ready_pop(s);
+	if (to == NULL)
+		to = &s->main;
+	coro_yield_to(to, CORO_SWITCH_SUSPEND);
+}
+
+/**
+ * Suspend until a wakeup or the deadline.
+ *
+ * @retval true Woken up.
+ * @retval false The deadline has come.
+ */
+static bool
+coro_suspend_until(long long deadline)
+{
+	struct coro_sched *s = coro_sched_ptr;
+	struct coro *c = coro_this_ptr;
+	if (c == &s->main) {
+		/* Nobody can wake the scheduler up, just sleep. */
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+		return false;
+	}
+	struct coro_timers *t = &s->timers;
+	coro_timers_lock(t);
+	coro_timers_add(t, c, deadline);
+	coro_timers_unlock(t);
+	coro_suspend();
+	/*
+	 * The timer is still there, if the wakeup came from somebody
+	 * else. The coroutine could move to another thread since
+	 * then, but the timer stays in the old scheduler.
+	 */
+	bool is_woken_up = false;
+	coro_timers_lock(t);
+	if (c->timers == t) {
+		coro_timers_remove(t, c);
+		is_woken_up = true;
+	}
+	coro_timers_unlock(t);
+	return is_woken_up;
+}
+
+bool
+coro_is_cancelled(void)
+{
+	return __atomic_load_n(&coro_this_ptr->is_cancelled,
+			       __ATOMIC_RELAXED);
+}
+
+int
+coro_suspend_timeout(long long timeout)
+{
+	/* A cancel before the timer is armed would be missed. */
+	if (coro_is_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
+	bool is_woken_up = coro_suspend_until(coro_clock() + timeout);
+	if (coro_is_cancelled()) {
+		errno = ECANCELED;
+		return -1;
+	}
+	if (is_woken_up)
+		return 0;
+	errno = ETIMEDOUT;
+	return -1;
+}
+
+void
+coro_sleep(long long duration)
+{
+	long long deadline = coro_clock() + duration;
+	/* Wakeups by other coroutines do not end the sleep. */
+	while (!coro_is_cancelled() && coro_suspend_until(deadline) &&
+	       coro_clock() < deadline)
+		;
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	int old = __atomic_exchange_n(&c->wake_state, CORO_WAKE_SIGNALED,
+				      __ATOMIC_SEQ_CST);
+	if (old != CORO_WAKE_SUSPENDED)
+		return;
+	__atomic_store_n(&c->wake_state, CORO_WAKE_NONE, __ATOMIC_SEQ_CST);
+	/*
+	 * A worker takes the coroutine to itself, the others give
+	 * it back to where it ran before.
+	 */
+	struct coro_sched *s = coro_sched_ptr;
+	if (s == NULL || s == &coro_sched_main)
+		s = c->sched;
+	coro_ready_push(s, c);
+}
+
+/** Prepare a scheduler of a thread. */
+static void
+coro_sched_create(struct coro_sched *s)
+{
+	pthread_once(&coro_ticks_once, coro_ticks_base_init);
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->lock, NULL);
+	coro_io_create(&s->io);
+	coro_timers_create(&s->timers);
+}
+
+static void
+coro_sched_delete(struct coro_sched *s)
+{
+	free(s->ready.heap);
+#ifdef CORO_TRACE
+	free(s->trace.events);
+#endif
+	coro_locals_destroy(&s->main);
+	coro_io_destroy(&s->io);
+	coro_timers_destroy(&s->timers);
+	pthread_mutex_destroy(&s->lock);
 }
 
 void
 coro_sched_init(void)
 {
-	memset(&coro_sched, 0, sizeof(coro_sched));
-	coro_this_ptr = &coro_sched;
+	if (coro_sched_ptr == &coro_sched_main)
+		coro_sched_delete(&coro_sched_main);
+	coro_sched_create(&coro_sched_main);
+	coro_sched_ptr = &coro_sched_main;
+	coro_this_ptr = &coro_sched_main.main;
+	__atomic_store_n(&coro_policy_ptr, &coro_policy_rr, __ATOMIC_RELAXED);
+}
+
+void
+coro_sched_set_policy(enum coro_sched_policy policy)
+{
+	const struct coro_policy *p;
+	switch (policy) {
+	case CORO_SCHED_PRIORITY:
+		p = &coro_policy_prio;
+		break;
+	case CORO_SCHED_EDF:
+		p = &coro_policy_edf;
+		break;
+	default:
+		p = &coro_policy_rr;
+		break;
+	}
+	__atomic_store_n(&coro_policy_ptr, p, __ATOMIC_RELAXED);
+}
+
+/** Try to take a ready coroutine of another worker. */
+static struct coro *
+coro_steal(struct coro_sched *thief)
+{
+	int count = coro_mt.worker_count;
+	int start = thief - coro_mt.workers;
+	for (int i = 1; i < count; ++i) {
+		struct coro_sched *victim =
+			&coro_mt.workers[(start + i) % count];
+		if (__atomic_load_n(&victim->ready_size, __ATOMIC_RELAXED) == 0)
+			continue;
+		pthread_mutex_lock(&victim->lock);
+		struct coro *c = coro_policy()->steal(&victim->ready);
+		if (c != NULL) {
+			__atomic_sub_fetch(&victim->ready_size, 1,
+					   __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (c != NULL) {
+			__atomic_sub_fetch(&coro_mt.ready_count, 1,
+					   __ATOMIC_SEQ_CST);
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Sleep until there are ready coroutines anywhere. False, if the
+ * worker should exit instead.
+ */
+static bool
+coro_worker_idle(struct coro_sched *s)
+{
+	if (coro_io_waiter_count(&s->io) > 0 ||
+	    coro_timers_size(&s->timers) > 0) {
+		coro_sched_idle(s, CORO_MT_IDLE_TIMEOUT);
+		return true;
+	}
+	pthread_mutex_lock(&coro_mt.lock);
+	__atomic_add_fetch(&coro_mt.idle_count, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&coro_mt.ready_count, __ATOMIC_SEQ_CST) == 0 &&
+	       !coro_mt.is_stopping)
+		pthread_cond_wait(&coro_mt.idle_cond, &coro_mt.lock);
+	__atomic_sub_fetch(&coro_mt.idle_count, 1, __ATOMIC_SEQ_CST);
+	bool is_alive = !coro_mt.is_stopping ||
+			__atomic_load_n(&coro_mt.ready_count,
+					__ATOMIC_SEQ_CST) > 0;
+	pthread_mutex_unlock(&coro_mt.lock);
+	return is_alive;
+}
+
+/** Main loop of a worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_sched *s = arg;
+	coro_sched_ptr = s;
+	coro_this_ptr = &s->main;
+	while (true) {
+		struct coro *to = coro_ready_pop(s);
+		if (to == NULL)
+			to = coro_steal(s);
+		if (to == NULL) {
+			if (!coro_worker_idle(s))
+				break;
+			continue;
+		}
+		s->is_waiting = true;
+		coro_yield_to(to, CORO_SWITCH_NONE);
+		s->is_waiting = false;
+	}
+	return NULL;
+}
+
+int
+coro_sched_init_workers(int count)
+{
+	coro_sched_init();
+	if (count <= 0)
+		return 0;
+	coro_mt.workers = calloc(count, sizeof(coro_mt.workers[0]));
+	if (coro_mt.workers == NULL)
+		return -1;
+	coro_mt.worker_count = count;
+	coro_mt.next_worker = 0;
+	coro_mt.live_count = 0;
+	coro_mt.is_stopping = false;
+	coro_mt.ready_count = 0;
+	coro_mt.idle_count = 0;
+	memset(&coro_mt.finished, 0, sizeof(coro_mt.finished));
+	for (int i = 0; i < count; ++i)
+		coro_sched_create(&coro_mt.workers[i]);
+	coro_mt.is_enabled = true;
+	for (int i = 0; i < count; ++i) {
+		struct coro_sched *w = &coro_mt.workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_f, w) != 0)
+			handle_error();
+	}
+	return 0;
+}
+
+void
+coro_sched_destroy(void)
+{
+	if (coro_mt.is_enabled) {
+		pthread_mutex_lock(&coro_mt.lock);
+		coro_mt.is_stopping = true;
+		pthread_cond_broadcast(&coro_mt.idle_cond);
+		pthread_mutex_unlock(&coro_mt.lock);
+		for (int i = 0; i < coro_mt.worker_count; ++i)
+			pthread_join(coro_mt.workers[i].thread, NULL);
+		coro_mt.is_enabled = false;
+		for (int i = 0; i < coro_mt.worker_count; ++i)
+			coro_sched_delete(&coro_mt.workers[i]);
+		free(coro_mt.workers);
+		coro_mt.workers = NULL;
+		coro_mt.worker_count = 0;
+	}
+	coro_sched_delete(&coro_sched_main);
+	coro_sched_create(&coro_sched_main);
+}
+
+/** Wait for a finish of a coroutine running on a worker. */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+	pthread_mutex_lock(&coro_mt.lock);
+	while (coro_mt.finished.first == NULL && coro_mt.live_count > 0)
+		pthread_cond_wait(&coro_mt.finished_cond, &coro_mt.lock);
+	struct coro *c = coro_queue_pop(&coro_mt.finished);
+	if (c != NULL)
+		--coro_mt.live_count;
+	pthread_mutex_unlock(&coro_mt.lock);
+	return c;
+}
+
+/**
+ * Run the coroutines of the scheduler thread until one of them
+ * finishes, or sleep until something is ready. False, if nobody
+ * can run and nothing is awaited.
+ */
+static bool
+coro_sched_step(struct coro_sched *s)
+{
+	/*
+	 * Coroutines switch between each other directly and come
+	 * back here only when one of them finishes.
+	 */
+	struct coro *to = coro_policy()->pop(&s->ready);
+	if (to == NULL) {
+		if (coro_io_waiter_count(&s->io) == 0 &&
+		    coro_timers_size(&s->timers) == 0)
+			return false;
+		/*
+		 * Idle - sleep until some descriptors are ready or
+		 * the nearest timer expires.
+		 */
+		coro_sched_idle(s, -1);
+		return true;
+	}
+	s->is_waiting = true;
+	coro_yield_to(to, CORO_SWITCH_NONE);
+	s->is_waiting = false;
+	return true;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
+	if (coro_mt.is_enabled)
+		return coro_sched_wait_mt();
+	struct coro_sched *s = &coro_sched_main;
+	while (true) {
+		struct coro *c = coro_queue_pop(&s->finished);
+		if (c != NULL)
+			return c;
+		if (!coro_sched_step(s))
+			return NULL;
+	}
+}
+
+struct coro_group *
+coro_group_new(void)
+{
+	struct coro_group *g = calloc(1, sizeof(*g));
+	if (g == NULL)
+		handle_error();
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	return g;
+}
+
+void
+coro_group_delete(struct coro_group *g)
+{
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
+	free(g->children);
+	free(g);
+}
+
+/** Add a new coroutine to the group, before it is started. */
+static void
+coro_group_add(struct coro_group *g, struct coro *c)
+{
+	coro_mt_lock(&g->lock);
+	if (g->child_count == g->child_capacity) {
+		int capacity = g->child_capacity == 0 ? 16 :
+			       g->child_capacity * 2;
+		struct coro **children =
+			realloc(g->children, capacity * sizeof(children[0]));
+		if (children == NULL)
+			handle_error();
+		g->children = children;
+		g->child_capacity = capacity;
+	}
+	g->children[g->child_count++] = c;
+	++g->live_count;
+	c->group = g;
+	c->is_cancelled = g->is_cancelled;
+	coro_mt_unlock(&g->lock);
+}
+
+void
+coro_group_cancel(struct coro_group *g)
+{
+	coro_mt_lock(&g->lock);
+	coro_group_cancel_locked(g);
+	coro_mt_unlock(&g->lock);
+}
+
+int
+coro_group_join(struct coro_group *g)
+{
+	struct coro_sched *s = coro_sched_ptr;
+	struct coro *c = coro_this_ptr;
+	coro_mt_lock(&g->lock);
+	if (c != &s->main) {
+		g->joiner = c;
+		while (g->live_count > 0) {
+			coro_mt_unlock(&g->lock);
+			coro_suspend();
+			coro_mt_lock(&g->lock);
+		}
+		g->joiner = NULL;
+	} else if (coro_mt.is_enabled) {
+		while (g->live_count > 0)
+			pthread_cond_wait(&g->cond, &g->lock);
+	} else {
+		/*
+		 * The children run in this thread. Other finished
+		 * coroutines stay for coro_sched_wait().
+		 */
+		while (g->live_count > 0) {
+			if (!coro_sched_step(s)) {
+				printf("Critical error - the group "
+				       "children can never finish!\n");
+				exit(-1);
 			}
 		}
-		is_sched_waiting = true;
-		coro_yield_to(coro_list);
-		is_sched_waiting = false;
 	}
-	return NULL;
+	int error = g->error;
+	/* The lock protects from the finishing children still. */
+	coro_mt_unlock(&g->lock);
+	for (int i = 0; i < g->child_count; ++i)
+		coro_delete(g->children[i]);
+	g->child_count = 0;
+	return error;
+}
+
+#ifdef CORO_TRACE
+
+/** Call @a f for each scheduler, with its number. */
+static void
+coro_sched_foreach(void (*f)(struct coro_sched *s, int i, void *arg),
+		   void *arg)
+{
+	f(&coro_sched_main, 0, arg);
+	for (int i = 0; i < coro_mt.worker_count; ++i)
+		f(&coro_mt.workers[i], i + 1, arg);
+}
+
+static void
+coro_trace_start_f(struct coro_sched *s, int i, void *arg)
+{
+	(void)i;
+	size_t capacity = *(size_t *)arg;
+	struct coro_trace *t = &s->trace;
+	__atomic_store_n(&t->is_enabled, false, __ATOMIC_RELAXED);
+	free(t->events);
+	t->events = calloc(capacity, sizeof(t->events[0]));
+	if (t->events == NULL)
+		handle_error();
+	t->mask = capacity - 1;
+	t->pos = 0;
+	__atomic_store_n(&t->is_enabled, true, __ATOMIC_RELEASE);
+}
+
+int
+coro_trace_start(size_t event_count)
+{
+	size_t capacity = 1;
+	while (capacity < event_count)
+		capacity *= 2;
+	coro_sched_foreach(coro_trace_start_f, &capacity);
+	return 0;
+}
+
+static void
+coro_trace_stop_f(struct coro_sched *s, int i, void *arg)
+{
+	(void)i;
+	(void)arg;
+	__atomic_store_n(&s->trace.is_enabled, false, __ATOMIC_RELAXED);
 }
 
+void
+coro_trace_stop(void)
+{
+	coro_sched_foreach(coro_trace_stop_f, NULL);
+}
+
+struct coro_trace_dump_ctx {
+	FILE *f;
+	bool is_first;
+};
+
+/**
+ * Write the switches of a scheduler as complete events: a slice
+ * of each coroutine lasts from the switch to it until the next
+ * switch. The thread is the scheduler number.
+ */
+static void
+coro_trace_dump_f(struct coro_sched *s, int i, void *arg)
+{
+	struct coro_trace_dump_ctx *ctx = arg;
+	struct coro_trace *t = &s->trace;
+	if (t->events == NULL || t->pos == 0)
+		return;
+	size_t count = t->pos < t->mask + 1 ? t->pos : t->mask + 1;
+	size_t begin = t->pos - count;
+	for (size_t pos = begin; pos + 1 < t->pos; ++pos) {
+		struct coro_trace_event *e = &t->events[pos & t->mask];
+		struct coro_trace_event *next =
+			&t->events[(pos + 1) & t->mask];
+		if (!ctx->is_first)
+			fprintf(ctx->f, ",\n");
+		ctx->is_first = false;
+		if (e->to == 0)
+			fprintf(ctx->f, "{\"name\":\"scheduler\"");
+		else
+			fprintf(ctx->f, "{\"name\":\"coro %d\"", e->to);
+		fprintf(ctx->f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+			i, e->time / 1000.0, (next->time - e->time) / 1000.0,
+			coro_trace_reason_strs[next->reason]);
+	}
+}
+
+int
+coro_trace_dump(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	struct coro_trace_dump_ctx ctx = {f, true};
+	fprintf(f, "{\"traceEvents\":[\n");
+	coro_sched_foreach(coro_trace_dump_f, &ctx);
+	fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
+
+#else /* CORO_TRACE */
+
+int
+coro_trace_start(size_t event_count)
+{
+	(void)event_count;
+	errno = ENOTSUP;
+	return -1;
+}
+
+void
+coro_trace_stop(void)
+{
+}
+
+int
+coro_trace_dump(const char *path)
+{
+	(void)path;
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif /* CORO_TRACE */
+
 struct coro *
 coro_this(void)
 {
 	return coro_this_ptr;
 }
 
+bool
+coro_can_suspend(void)
+{
+	struct coro_sched *s = coro_sched_ptr;
+	return s != NULL && coro_this_ptr != &s->main;
+}
+
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Entry point of each coroutine. It is reached by the first
+ * switch to the coroutine, on its own stack.
  */
 static void
-coro_body(int signum)
+coro_body(void)
 {
-	(void)signum;
+	coro_switch_done();
 	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
 	c->ret = c->func(c->func_arg);
 	c->is_finished = true;
-	/* Can not return - 'ret' address is invalid already! */
-	if (! is_sched_waiting) {
+	/* The thread could change while the function worked. */
+	struct coro_sched *s = coro_sched_ptr;
+	/* Can not return - there is no caller on that stack. */
+	if (! s->is_waiting) {
 		printf("Critical error - no place to return!\n");
 		exit(-1);
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_yield_to(&s->main, CORO_SWITCH_FINISH);
 }
 
+/** The last given coroutine id. */
+static int coro_id_last = 0;
+
 struct coro *
-coro_new(coro_f func, void *func_arg)
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
 {
+	size_t stack_size = CORO_STACK_SIZE_DEFAULT;
+	if (attr != NULL && attr->stack_size != 0)
+		stack_size = attr->stack_size;
+	size_t page_size = coro_page_size();
+	stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
 	struct coro *c = (struct coro *) malloc(sizeof(*c));
 	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	c->has_stack_guard = attr == NULL || !attr->no_guard;
+	c->stack = coro_stack_new(stack_size, c->has_stack_guard);
+	c->stack_size = stack_size;
 	c->func = func;
 	c->func_arg = func_arg;
 	c->is_finished = false;
+	c->wake_state = CORO_WAKE_NONE;
 	c->switch_count = 0;
+	c->id = __atomic_add_fetch(&coro_id_last, 1, __ATOMIC_RELAXED);
+	c->run_time = 0;
+	c->slice_start = 0;
+	c->quantum = 0;
+	c->quantum_start = 0;
+	c->quantum_check_countdown = 0;
+	if (attr != NULL)
+		coro_set_quantum(c, attr->quantum);
+	memset(c->locals, 0, sizeof(c->locals));
+	c->arena = NULL;
+	c->deadline = 0;
+	c->timers = NULL;
+	c->io = NULL;
+	c->timer_pos = -1;
+	c->priority = 0;
+	c->latency = 0;
+	c->ready_time = 0;
+	c->hists = NULL;
+	if (attr != NULL) {
+		coro_set_priority(c, attr->priority);
+		coro_set_latency(c, attr->latency);
+		if (attr->histograms) {
+			c->hists = calloc(1, sizeof(*c->hists));
+			if (c->hists == NULL)
+				handle_error();
+		}
+	}
+	c->group = NULL;
+	c->is_cancelled = false;
+	if (attr != NULL && attr->group != NULL)
+		coro_group_add(attr->group, c);
 	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
-	}
-	coro_this_ptr = old_this;
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
+	 * The coroutine starts in coro_body() when it is switched
+	 * to for the first time.
 	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
-
+	coro_ctx_make(&c->ctx, c->stack, stack_size, coro_body);
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	struct coro_sched *s = coro_sched_ptr;
+	if (coro_mt.is_enabled) {
+		pthread_mutex_lock(&coro_mt.lock);
+		++coro_mt.live_count;
+		/* Spread the coroutines created outside of workers. */
+		if (s == NULL || s == &coro_sched_main) {
+			s = &coro_mt.workers[coro_mt.next_worker];
+			coro_mt.next_worker = (coro_mt.next_worker + 1) %
+					      coro_mt.worker_count;
+		}
+		pthread_mutex_unlock(&coro_mt.lock);
+	}
+	c->sched = s;
+	coro_ready_push(s, c);
 	return c;
 }
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, NULL);
+}
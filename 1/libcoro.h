@@ -1,17 +1,83 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct coro;
+struct coro_group;
 typedef int (*coro_f)(void *);
 
 /** Make current context scheduler. */
 void
 coro_sched_init(void);
 
+/** Order in which the ready coroutines run. */
+enum coro_sched_policy {
+	/** First ready - first run. The default. */
+	CORO_SCHED_ROUND_ROBIN,
+	/**
+	 * Higher priority first, round-robin on the same priority.
+	 * A yield does not switch to a lower priority.
+	 */
+	CORO_SCHED_PRIORITY,
+	/**
+	 * Earliest deadline first. The deadline is the time the
+	 * coroutine has become ready plus its latency. Coroutines
+	 * without latency run after all the others, round-robin.
+	 */
+	CORO_SCHED_EDF,
+};
+
+enum {
+	/** Priorities are from 0, the default, to this. */
+	CORO_PRIORITY_MAX = 31,
+};
+
+/**
+ * Set the scheduling policy of all the schedulers. It should be
+ * called when no coroutines are ready, for example right after
+ * coro_sched_init(), which resets it to round-robin.
+ */
+void
+coro_sched_set_policy(enum coro_sched_policy policy);
+
 /**
- * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * Make current context scheduler and start @a count worker
+ * threads, each with its own scheduler. Coroutines created
+ * outside of the workers are spread between them, and the ones
+ * created by a coroutine stay on its worker. An idle worker
+ * steals ready coroutines from the others, so a coroutine can
+ * continue on another thread after any yield or suspension.
+ * Therefore it should not keep pointers to thread-local data
+ * across switches, and should protect the data shared with other
+ * coroutines like with threads.
+ *
+ * The current context runs no coroutines then, it only waits for
+ * them in coro_sched_wait(). 0 workers is the same as
+ * coro_sched_init().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+int
+coro_sched_init_workers(int count);
+
+/**
+ * Free the resources of the scheduler, like its epoll
+ * descriptor, stop and join the worker threads. All the
+ * coroutines should be finished and returned by
+ * coro_sched_wait().
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Block until any coroutine has finished. It is returned. NULL,
+ * if no coroutines can run - all of them are finished and
+ * returned already, or suspended. When nobody can run but some
+ * coroutines wait for file descriptors, the scheduler sleeps in
+ * epoll_wait() until they are ready. With worker threads NULL is
+ * returned only when all coroutines are finished and returned.
  */
 struct coro *
 coro_sched_wait(void);
@@ -20,13 +86,124 @@ coro_sched_wait(void);
 struct coro *
 coro_this(void);
 
+/**
+ * True, if the caller is a coroutine. In a scheduler context, or
+ * in a thread without a scheduler, coro_suspend() returns right
+ * away, and a wait has to block the thread instead.
+ */
+bool
+coro_can_suspend(void);
+
 /**
  * Create a new coroutine. It is not started, just added to the
  * scheduler.
+ *
+ * The stack is a memory mapping with a guard page below it, which
+ * makes two mappings per coroutine. A process can have at most
+ * vm.max_map_count mappings, 65530 by default, so only about 32k
+ * coroutines with guarded stacks can exist at once. Beyond that
+ * a stack can't be mapped, and the process exits with an error.
+ * For more coroutines use coro_attr.no_guard.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes, rounded up to the page size. 0
+	 * means the default of 1 MiB.
+	 */
+	size_t stack_size;
+	/**
+	 * Time slice in nanoseconds for coro_yield_if_expired(). 0
+	 * or negative means unlimited.
+	 */
+	long long quantum;
+	/**
+	 * Group to put the coroutine into. Then it is not returned
+	 * by coro_sched_wait(), and coro_group_join() deletes it.
+	 */
+	struct coro_group *group;
+	/** Priority for CORO_SCHED_PRIORITY, see coro_set_priority(). */
+	int priority;
+	/** Latency for CORO_SCHED_EDF, see coro_set_latency(). */
+	long long latency;
+	/** Collect wait and run time histograms, coro_histograms(). */
+	bool histograms;
+	/**
+	 * No guard page below the stack. A stack overflow corrupts
+	 * the memory around silently then, but the stack is a single
+	 * mapping, merged with the neighbour stacks. See coro_new().
+	 */
+	bool no_guard;
+};
+
+/**
+ * Create a new coroutine with the given attributes. NULL
+ * attributes are the same as coro_new().
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/** Statistics of the coroutine stack pool. */
+struct coro_stack_pool_stat {
+	/** Stacks taken from the pool. */
+	long long hits;
+	/** Stacks which had to be mapped anew. */
+	long long misses;
+	/** Stacks waiting in the pool now. */
+	int count;
+};
+
+/** Get statistics of the coroutine stack pool. */
+void
+coro_stack_pool_stat(struct coro_stack_pool_stat *stat);
+
+/**
+ * Set how many released stacks the pool keeps for reuse. The
+ * extra ones are unmapped right away. 0 disables the pool.
+ */
+void
+coro_stack_pool_set_size(int max_count);
+
+/** Create an empty coroutine group. */
+struct coro_group *
+coro_group_new(void);
+
+/** Free the group. Its children should be joined already. */
+void
+coro_group_delete(struct coro_group *g);
+
+/**
+ * Wait until all the children of the group finish, and delete
+ * them. Other coroutines keep running meanwhile, and the ones
+ * outside of the group, finished meanwhile, are still returned by
+ * coro_sched_wait(). Can be called from a coroutine, or from the
+ * scheduler context.
+ *
+ * @return The first non-zero status of a child, in the order of
+ *     finish, or 0.
+ */
+int
+coro_group_join(struct coro_group *g);
+
+/**
+ * Ask all the children of the group to stop, including the ones
+ * added later. The first child failing with a non-zero status
+ * does that too. Cancellation is cooperative: the suspended
+ * children are woken up, their coro_sleep() ends,
+ * coro_suspend_timeout() and coro_fd_wait() fail with ECANCELED.
+ * Running children should check coro_is_cancelled() at their
+ * yield points.
+ */
+void
+coro_group_cancel(struct coro_group *g);
+
+/** True, if the current coroutine was asked to stop. */
+bool
+coro_is_cancelled(void);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -34,14 +211,236 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/**
+ * Time the coroutine has been running, in nanoseconds. It is
+ * accounted on each switch, so waiting in the ready queue or in
+ * suspension is not included.
+ */
+long long
+coro_run_time(const struct coro *c);
+
+/**
+ * Set time slice of the coroutine in nanoseconds, used by
+ * coro_yield_if_expired(). 0 means unlimited.
+ */
+void
+coro_set_quantum(struct coro *c, long long quantum);
+
+/**
+ * Set priority of the coroutine for CORO_SCHED_PRIORITY, it is
+ * clamped to [0, CORO_PRIORITY_MAX]. Takes effect when the
+ * coroutine becomes ready next time.
+ */
+void
+coro_set_priority(struct coro *c, int priority);
+
+/**
+ * Set latency of the coroutine for CORO_SCHED_EDF in nanoseconds:
+ * how soon it should run after becoming ready. 0 means none.
+ */
+void
+coro_set_latency(struct coro *c, long long latency);
+
+enum {
+	/** Bucket i counts values in [2^i, 2^(i + 1)). */
+	CORO_HIST_BUCKET_COUNT = 40,
+};
+
+/** Histogram of durations in nanoseconds, log2 buckets. */
+struct coro_hist {
+	long long counts[CORO_HIST_BUCKET_COUNT];
+	/** Number of values. */
+	long long count;
+	/** Sum of the values. */
+	long long sum;
+	/** The biggest value. */
+	long long max;
+};
+
+/**
+ * Get histograms of the coroutine: how long it waited in the
+ * ready queue before each switch to it, and how long it ran
+ * after that. Either pointer can be NULL.
+ *
+ * @retval 0 Success.
+ * @retval -1 The coroutine was created without
+ *         coro_attr.histograms.
+ */
+int
+coro_histograms(const struct coro *c, struct coro_hist *wait,
+		struct coro_hist *run);
+
+/**
+ * Upper bound of the bucket containing the given percentile,
+ * from 0 to 100, but not more than the max value.
+ */
+long long
+coro_hist_percentile(const struct coro_hist *h, double percentile);
+
+/**
+ * Start recording the context switches of all the schedulers, up
+ * to @a event_count recent ones per scheduler. A switch is
+ * recorded with the coroutine ids, the time and why the previous
+ * coroutine stopped - yield, suspend or finish. The tracing is
+ * compiled in only with CORO_TRACE defined, otherwise the switches
+ * do not check for it at all. Should be called after the
+ * schedulers are created, while no coroutines run. A repeated
+ * call drops the recorded events.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is ENOTSUP - the tracing is not built.
+ */
+int
+coro_trace_start(size_t event_count);
+
+/** Stop recording the switches. The events are kept for dump. */
+void
+coro_trace_stop(void);
+
+/**
+ * Write the recorded switches to a file in Chrome trace JSON
+ * format, viewable in chrome://tracing or Perfetto. Each scheduler
+ * is a thread there, and each coroutine run is a slice. Should be
+ * called when the tracing is stopped, or no coroutines run.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_dump(const char *path);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free the coroutine. Its stack goes back to the stack pool,
+ * when there is room there.
+ */
 void
 coro_delete(struct coro *c);
 
+/**
+ * Allocate @a size bytes in the arena of the current coroutine.
+ * The memory is aligned by 16 and lives until coro_arena_free()
+ * or coro_delete(), which frees the whole arena at once. An
+ * allocation is a pointer bump in most cases. The arena of the
+ * scheduler context lives until the next coro_sched_init() or
+ * coro_sched_destroy().
+ */
+void *
+coro_alloc(size_t size);
+
+/**
+ * Free @a ptr, returned by coro_alloc() of the current coroutine,
+ * and everything allocated after it, like obstack_free(). NULL
+ * frees the whole arena. The memory is kept for the next
+ * allocations.
+ */
+void
+coro_arena_free(void *ptr);
+
+/**
+ * Create a coroutine-local key, like pthread_key_create(). Each
+ * coroutine has its own value for the key, NULL initially. The
+ * destructor, if any, is called for a non-NULL value in
+ * coro_delete(). Up to 16 keys can be created, and they are not
+ * deleted.
+ *
+ * @retval >= 0 The key.
+ * @retval -1 Error, errno is EAGAIN - no more keys.
+ */
+int
+coro_key_create(void (*destructor)(void *));
+
+/** Set the value of the key for the current coroutine. */
+void
+coro_key_set(int key, void *value);
+
+/** Get the value of the key for the current coroutine. */
+void *
+coro_key_get(int key);
+
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Yield, if the current coroutine has been running longer than its
+ * quantum since it was switched to. The clock is read only once
+ * per several calls, so it is cheap enough to call on each
+ * iteration of a hot loop. When nobody else can run, a new slice
+ * starts without a switch.
+ *
+ * @retval true The coroutine yielded.
+ * @retval false The quantum is not over, or there was nothing to
+ *     switch to.
+ */
+bool
+coro_yield_if_expired(void);
+
+/**
+ * Stop the current coroutine until coro_wakeup() is called for
+ * it. A suspended coroutine is not scheduled at all.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Suspend the current coroutine like coro_suspend(), but for no
+ * longer than @a timeout nanoseconds. The scheduler sleeps in the
+ * kernel until the nearest deadline, when nobody can run. When
+ * called not from a coroutine, just sleeps.
+ *
+ * @retval 0 Woken up by coro_wakeup().
+ * @retval -1 The timeout expired, errno is ETIMEDOUT, or the
+ *     coroutine is cancelled, errno is ECANCELED. A wakeup
+ *     racing with the timeout, or coming from another thread
+ *     right after it, can remain pending and end the next
+ *     suspension early.
+ */
+int
+coro_suspend_timeout(long long timeout);
+
+/**
+ * Stop the current coroutine for @a duration nanoseconds. Other
+ * coroutines run meanwhile. Coro_wakeup() does not end the sleep
+ * earlier. When called not from a coroutine, just sleeps.
+ */
+void
+coro_sleep(long long duration);
+
+enum coro_fd_event {
+	CORO_FD_READ = 1,
+	CORO_FD_WRITE = 2,
+};
+
+/**
+ * Suspend the current coroutine until the file descriptor is
+ * ready for the events - a mask of enum coro_fd_event. Only one
+ * coroutine can wait for reading, and one for writing, on the
+ * same descriptor. The wait can end spuriously, so the caller
+ * should retry the operation, and wait again on EAGAIN.
+ * When called not from a coroutine, just blocks the thread.
+ *
+ * @retval 0 The descriptor could be ready.
+ * @retval -1 Error, errno is set. EBUSY - somebody else waits
+ *     for the same event on that descriptor. ECANCELED - the
+ *     coroutine is cancelled.
+ */
+int
+coro_fd_wait(int fd, int events);
+
+/**
+ * Make a suspended coroutine runnable again. It is put to the end
+ * of the ready queue. When the coroutine is not suspended yet, its
+ * next coro_suspend() returns right away, so a wakeup is never
+ * lost.
+ *
+ * Call it from the thread of the coroutine's scheduler, or from
+ * any thread when there are worker threads. Without them the
+ * ready queue is not locked, and a scheduler waiting for
+ * descriptors or timers is not woken up by other threads.
+ */
+void
+coro_wakeup(struct coro *c);
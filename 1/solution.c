@@ -1,18 +1,194 @@
 // #define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "libcoro.h"
+#include "coro_io.h"
 #include "../utils/heap_help/heap_help.h"
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-static char *readFile(char *filename);						   // read file and return string
-static int *parseNumbers(char *str);						   // parse string to array of numbers
-static void writeFile(char *filename, int *numbers, int size); // write array of numbers to file
+struct merger;
+struct merge_run;
+struct number_reader;
+struct spill;
+static char *mapFile(char *filename, size_t *size);			   // map file read-only and return its contents
+static int *readNumbers(char *filename);						   // read array of numbers of the file in the input format by chunks
+static int *parseNumbers(const char *str, size_t length);		   // parse string to array of numbers
+static int *decodeNumbers(const char *data, size_t length, char *filename); // read array of numbers in the input format
+static void decodeRaw(const char *data, int *out, int count);	   // copy little-endian int32 numbers
+static const char *parseRange(const char *str, const char *end, int *out, int max, int *count); // parse up to max numbers, return where it stopped
+static void readerCreate(struct number_reader *r, char *filename, int bufferSize); // open a file to read numbers by chunks
+static void readerFill(struct number_reader *r);				   // take the chunk read ahead, start reading the next one
+static int readerNext(struct number_reader *r, int *out, int max); // read up to max numbers, 0 at the end
+static void readerDestroy(struct number_reader *r);				   // close the file, free the buffers
+static void writeFile(char *filename, struct merger *m);		   // write the merged runs to file
+static char *formatNumber(int number, char *out);			   // write number as text, return its end
+static char *encodeVarint(unsigned value, char *out);			   // write value as LEB128, return its end
+static void writeAll(int fd, const char *data, size_t size);   // write the whole data to fd
 /*MergeSort functions*/
-static int *merge(int *a, int *b);					 // merge two sorted arrays
-static int *mergeSort(int *numbers, void *context);	 // sort array using merge sort
-static int *mergeSortArrays(int **arrays, int size); // sort array of sorted arrays using merge sort
+static void mergeRange(int *a, int sizeA, int *b, int sizeB, int *merged); // merge two sorted ranges into merged
+static int *mergeSort(int *numbers);					 // sort array in place by the selected engine
+static void mergeSortInto(int *data, int *aux, int size); // sort data, aux holds the same numbers
+static void sortInto(int *data, int *aux, int size);		 // sort data by the selected engine, aux holds the same numbers
+static void radixSortInto(int *data, int *aux, int size); // LSD radix sort, aux holds the same numbers
+static void simdSortInto(int *data, int *aux, int size);	 // sorting network and bitonic merges, aux holds the same numbers
+static bool simdSupported(void);							 // whether the CPU runs the simd engine
+/*K-way merge functions*/
+static void mergerCreate(struct merger *m, int capacity);		  // create an empty merger for up to capacity runs
+static void mergerBuild(struct merger *m);						  // play the first round of the merge
+static void mergerAdd(struct merger *m, int *begin, int *end);	  // add a sorted run
+static void mergerAddFile(struct merger *m, int fd, off_t offset, long long count, int bufferSize); // add a sorted run from a file
+static bool mergerRefill(struct merge_run *r);					  // read the next part of a run from its file
+static int mergerNext(struct merger *m, int *out, int max);		  // take up to max smallest numbers, return how many
+static void mergerDestroy(struct merger *m);					  // free the merger
+static int *mergeRuns(int **runs, int count);					  // merge sorted runs into a new array
+/*Parallel mode functions*/
+static int **sortFiles(int threads, int T, int coroutines, char **files, int count, double *workTime, int *switches, int *runCount); // sort files into runs
+static void sortPieces(int *numbers, int pieces, double quantum, int **runs);					// sort a file in pieces by child coroutines
+static int *mergeRunsParallel(int **runs, int count, int parts);								// k-way merge of sorted runs in parts
+static struct spill *spillSort(int T, int coroutines, char **files, int count, long long budget, double *workTime, int *switches); // sort files into spilled runs
+static void spillRun(struct spill *spill, int *numbers, int *aux, int size); // sort numbers and append them to the spill
+static void spillMerge(char *filename, struct spill *spill, long long budget); // merge the spilled runs into file
+static void spillDelete(struct spill *spill);													// remove the spill
+static int lowerBound(int *run, int value);														// index of the first number >= value in a run
+static double clockSeconds(void);																// monotonic time in seconds
+static void benchParse(int megabytes);																// measure parseNumbers() speed
+static void benchMerge(void);																		// measure mergeRuns() speed on 2..1024 runs
+static void benchSort(void);																		// measure the sort engines on input sizes and value ranges
+static void benchParallel(int threads, int T, int coroutines, char **files, int count);				// compare the sort on worker threads with the one on one thread
+
+enum
+{
+	// a file is split into pieces of at least that many numbers
+	PIECE_SIZE_MIN = 1 << 14,
+	// ranges up to that size are sorted by insertion
+	INSERTION_SORT_MAX = 16,
+	// result text is flushed by chunks of that size
+	OUTPUT_BUFFER_SIZE = 1 << 20,
+	// "-2147483648 ", longer than any binary number too
+	NUMBER_TEXT_MAX = 12,
+	// the merge streams into the output by blocks of that many numbers
+	MERGE_BLOCK_SIZE = 4096,
+	// the input is read by chunks of at most that size
+	INPUT_CHUNK_SIZE = 1 << 20,
+	// a token cut by the end of a chunk is carried over to the next one, when not longer than that
+	READER_CARRY_MAX = 4096,
+	// and the spilled runs by at least that many numbers
+	SPILL_READ_MIN = 1024,
+	// radix sort takes 11 bits of a number per pass
+	RADIX_BITS = 11,
+	RADIX_BUCKETS = 1 << RADIX_BITS,
+	RADIX_DIGITS = 3,
+	// smaller arrays are not worth the counts and go to the merge sort
+	RADIX_SORT_MIN = 1 << 10,
+	// numbers in an AVX2 vector
+	SIMD_WIDTH = 8,
+	// the sorting network sorts blocks of eight vectors
+	SIMD_BLOCK_SIZE = SIMD_WIDTH * SIMD_WIDTH,
+	// radix and simd sorts check the quantum every that many numbers of a pass
+	SORT_YIELD_BLOCK = 1 << 12,
+};
+
+enum sort_engine
+{
+	SORT_MERGE,
+	SORT_RADIX,
+	SORT_SIMD,
+};
+
+// set by '-s' before any sort starts, read by all the threads
+static enum sort_engine sortEngine = SORT_MERGE;
+
+enum number_format
+{
+	// decimal numbers separated by whitespace
+	FORMAT_TEXT,
+	// little-endian int32 one after another
+	FORMAT_RAW,
+	// output only, LEB128 varints of the differences between neighbours, the first one from 0
+	FORMAT_DELTA,
+};
+
+// set by '-i' and '-o' before any file is read
+static enum number_format inputFormat = FORMAT_TEXT;
+static enum number_format outputFormat = FORMAT_TEXT;
+
+// set by '-r', the input files are mapped whole, or read by chunks with an asynchronous read-ahead
+static bool readAhead = false;
+
+// bigger than any node with a number, so an empty run loses every match
+#define MERGE_NODE_END UINT64_MAX
+
+// a run in the k-way merge
+struct merge_run
+{
+	int *pos; // the numbers after the current one
+	int *end;
+	// a run in a file is read into the buffer by parts, fd is -1 for a run in memory
+	int fd;
+	off_t offset;	// where the unread part of the run starts
+	long long left; // numbers not read yet
+	int *buffer;
+	int bufferSize;
+};
+
+// reads numbers from a file by chunks, the next chunk is read asynchronously while this one is parsed
+struct number_reader
+{
+	int fd;
+	char *filename;
+	// the chunks start after READER_CARRY_MAX bytes for the cut token
+	char *buffer;	 // the chunk being parsed
+	char *ahead;	 // the chunk being read
+	int bufferSize; // bytes of a chunk
+	struct coro_aio read;
+	bool isReading; // the read of ahead is in flight
+	char *pos;		 // the next byte to parse
+	char *end;		 // the end of the read bytes
+	char *parseEnd;	 // the end of the complete numbers, the last whitespace
+	off_t offset;	 // where the next chunk starts in the file
+	bool isEof;
+};
+
+// a sorted run in the spill file
+struct spill_run
+{
+	off_t offset;
+	int count;
+};
+
+// sorted runs written to a temporary file, which is removed when closed
+struct spill
+{
+	int fd;
+	off_t size;
+	struct spill_run *runs;
+	int count;
+	int capacity;
+};
+
+// k-way merge of sorted runs by a loser tree, O(k) memory
+struct merger
+{
+	struct merge_run *runs;
+	// tree[0] is the winner, the others are the losers of their matches
+	// a node is the number in the high half, flipped to compare as unsigned, and the run in the low half
+	uint64_t *tree;
+	int count;				 // number of runs added
+	int capacity;			 // number of leaves, a power of two
+	int live;				 // number of runs not over yet
+	bool isBuilt;
+};
 
 struct my_context
 {
@@ -20,13 +196,43 @@ struct my_context
 	char ***filenames;	   // filenames
 	int ***sortedFiles;	   // array of arrays
 	double quantum;		   // T/N , stored in microseconds
-	struct timespec start; // start time of the coroutine
 	double *workTime;	   // work time of the coroutine in microseconds
 	int *switches;		   // number of switches done by the coroutine
+	int pieces;			   // max pieces per file, sortedFiles has that many runs per file
+};
+
+// a piece of a file sorted by its own coroutine
+struct piece_context
+{
+	int *numbers;	// the piece, numbers[0] is the size
+	double quantum; // stored in microseconds
+};
+
+// a coroutine of the spill mode, sorts runs of its numbers within its share of the memory budget
+struct spill_context
+{
+	int files;		  // number of files
+	char **filenames; // filenames, taken by the coroutines
+	struct spill *spill;
+	int runSize;	 // numbers in a run
+	int chunkSize;	 // bytes of the input read at once
+	double quantum;	 // stored in microseconds
+	double *workTime; // work time of the coroutine in microseconds
+	int *switches;	 // number of switches done by the coroutine
+};
+
+// a part of the output, merged from the same value range of all the runs
+struct merge_context
+{
+	int **runs;	  // sorted runs, runs[i][0] is the size
+	int count;	  // number of runs
+	int *starts;  // where the part starts in each run
+	int *ends;	  // where the part ends in each run
+	int *out;	  // where the part is written
 };
 
 static struct my_context *
-my_context_new(int files, char ***filenames, int ***sortedFiles, double quantum, double *workTime, int *switches)
+my_context_new(int files, char ***filenames, int ***sortedFiles, double quantum, double *workTime, int *switches, int pieces)
 {
 	struct my_context *ctx = malloc(sizeof(*ctx));
 	ctx->files = files;
@@ -35,6 +241,7 @@ my_context_new(int files, char ***filenames, int ***sortedFiles, double quantum,
 	ctx->quantum = quantum;
 	ctx->workTime = workTime;
 	ctx->switches = switches;
+	ctx->pieces = pieces;
 
 	return ctx;
 }
@@ -51,8 +258,8 @@ coroutine_func_f(void *context)
 	struct coro *this = coro_this();
 	struct my_context *ctx = context;
 	double *workTime = ctx->workTime;
-	// start timer
-	clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+	// libcoro measures the work time and the quantum itself
+	coro_set_quantum(this, ctx->quantum * 1000);
 
 	int files = ctx->files;
 	char ***filenames = ctx->filenames;
@@ -62,155 +269,1037 @@ coroutine_func_f(void *context)
 
 	for (int i = 0; i < files; i++)
 	{
-		if ((*filenames)[i] == NULL)
+		// with worker threads other coroutines take files concurrently
+		char *filename = __atomic_exchange_n(&(*filenames)[i], NULL, __ATOMIC_RELAXED);
+		if (filename == NULL)
 		{
 			continue;
 		}
-		char *filename = (*filenames)[i];
-		(*filenames)[i] = NULL;
 
-		char *input = readFile(filename);
-		int *numbers = parseNumbers(input);
-		(*sortedFiles)[i] = mergeSort(numbers, ctx);
-
-		free(numbers);
-		free(input);
+		int *numbers;
+		if (readAhead)
+		{
+			// the coroutine waits for the reads, the others sort meanwhile
+			numbers = readNumbers(filename);
+		}
+		else
+		{
+			size_t inputSize;
+			char *input = mapFile(filename, &inputSize);
+			numbers = decodeNumbers(input, inputSize, filename);
+			// the numbers are copied out, the mapping is not needed during the sort
+			if (input != NULL)
+				munmap(input, inputSize);
+		}
+		int pieces = numbers[0] / PIECE_SIZE_MIN;
+		if (pieces > ctx->pieces)
+			pieces = ctx->pieces;
+		if (pieces > 1)
+		{
+			sortPieces(numbers, pieces, ctx->quantum, *sortedFiles + i * ctx->pieces);
+			free(numbers);
+		}
+		else
+		{
+			(*sortedFiles)[i * ctx->pieces] = mergeSort(numbers);
+		}
 	}
 
 	*switches = coro_switch_count(this);
-	struct timespec end;
-	clock_gettime(CLOCK_MONOTONIC, &end);
-	double x = 1000000.0 * end.tv_sec + 1e-3 * end.tv_nsec - (1000000.0 * ctx->start.tv_sec + 1e-3 * ctx->start.tv_nsec);
-	*workTime += x;
+	*workTime = coro_run_time(this) / 1000.0;
 	my_context_delete(ctx);
 	return 0;
 }
 
+static int
+piece_func_f(void *context)
+{
+	struct piece_context *ctx = context;
+	coro_set_quantum(coro_this(), ctx->quantum * 1000);
+	mergeSort(ctx->numbers);
+	free(ctx);
+	return 0;
+}
+
+static int
+merge_func_f(void *context)
+{
+	struct merge_context *ctx = context;
+	struct merger m;
+	mergerCreate(&m, ctx->count);
+	int size = 0;
+	for (int i = 0; i < ctx->count; i++)
+	{
+		mergerAdd(&m, ctx->runs[i] + ctx->starts[i] + 1, ctx->runs[i] + ctx->ends[i] + 1);
+		size += ctx->ends[i] - ctx->starts[i];
+	}
+	mergerNext(&m, ctx->out, size);
+	mergerDestroy(&m);
+	free(ctx);
+	return 0;
+}
+
+static int
+spill_func_f(void *context)
+{
+	struct coro *this = coro_this();
+	struct spill_context *ctx = context;
+	coro_set_quantum(this, ctx->quantum * 1000);
+
+	int *numbers = malloc(sizeof(int) * ctx->runSize);
+	int *aux = malloc(sizeof(int) * ctx->runSize);
+	int size = 0;
+	for (int i = 0; i < ctx->files; i++)
+	{
+		char *filename = ctx->filenames[i];
+		if (filename == NULL)
+		{
+			continue;
+		}
+		ctx->filenames[i] = NULL;
+
+		// a run can take numbers of several files
+		struct number_reader reader;
+		readerCreate(&reader, filename, ctx->chunkSize);
+		int parsed;
+		while ((parsed = readerNext(&reader, numbers + size, ctx->runSize - size)) > 0)
+		{
+			size += parsed;
+			if (size == ctx->runSize)
+			{
+				spillRun(ctx->spill, numbers, aux, size);
+				size = 0;
+			}
+		}
+		readerDestroy(&reader);
+	}
+	if (size > 0)
+		spillRun(ctx->spill, numbers, aux, size);
+	free(aux);
+	free(numbers);
+
+	*ctx->switches = coro_switch_count(this);
+	*ctx->workTime = coro_run_time(this) / 1000.0;
+	free(ctx);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
-	struct timespec totalWorkTimeStart;
-	clock_gettime(CLOCK_MONOTONIC, &totalWorkTimeStart);
+	double totalWorkTimeStart = clockSeconds();
+	// '-b parse [megabytes]', '-b merge' and '-b sort' measure the parser, the merge and the sort engines on generated input
+	// '-b parallel <threads> T N files...' sorts the files on worker threads and on one thread, and prints the speed-up
+	if (argc > 2 && strcmp(argv[1], "-b") == 0)
+	{
+		if (strcmp(argv[2], "parse") == 0)
+			benchParse(argc > 3 ? atoi(argv[3]) : 100);
+		else if (strcmp(argv[2], "merge") == 0)
+			benchMerge();
+		else if (strcmp(argv[2], "sort") == 0)
+			benchSort();
+		else if (strcmp(argv[2], "parallel") == 0 && argc > 6)
+			benchParallel(atoi(argv[3]), atof(argv[4]), atoi(argv[5]), argv + 6, argc - 6);
+		return 0;
+	}
+	// '-j <threads>' shards the files across worker threads
+	// '-m <megabytes>' sorts within that memory, spilling sorted runs to disk
+	// '-s merge|radix|simd' selects the sort engine
+	// '-i text|raw' and '-o text|raw|delta' select the input and the output formats
+	// '-r mmap|aio' maps the input files, or reads them by chunks ahead of the parse
+	int threads = 0;
+	long long budget = 0;
+	while (argc > 2)
+	{
+		if (strcmp(argv[1], "-j") == 0)
+			threads = atoi(argv[2]);
+		else if (strcmp(argv[1], "-m") == 0)
+			budget = atoll(argv[2]) << 20;
+		else if (strcmp(argv[1], "-s") == 0)
+		{
+			if (strcmp(argv[2], "merge") == 0)
+				sortEngine = SORT_MERGE;
+			else if (strcmp(argv[2], "radix") == 0)
+				sortEngine = SORT_RADIX;
+			else if (strcmp(argv[2], "simd") == 0 && simdSupported())
+				sortEngine = SORT_SIMD;
+			else
+			{
+				printf("Critical error - unknown or unsupported sort engine %s\n", argv[2]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[1], "-i") == 0)
+		{
+			if (strcmp(argv[2], "text") == 0)
+				inputFormat = FORMAT_TEXT;
+			else if (strcmp(argv[2], "raw") == 0)
+				inputFormat = FORMAT_RAW;
+			else
+			{
+				printf("Critical error - unknown input format %s\n", argv[2]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[1], "-o") == 0)
+		{
+			if (strcmp(argv[2], "text") == 0)
+				outputFormat = FORMAT_TEXT;
+			else if (strcmp(argv[2], "raw") == 0)
+				outputFormat = FORMAT_RAW;
+			else if (strcmp(argv[2], "delta") == 0)
+				outputFormat = FORMAT_DELTA;
+			else
+			{
+				printf("Critical error - unknown output format %s\n", argv[2]);
+				exit(-1);
+			}
+		}
+		else if (strcmp(argv[1], "-r") == 0)
+		{
+			if (strcmp(argv[2], "mmap") == 0)
+				readAhead = false;
+			else if (strcmp(argv[2], "aio") == 0)
+				readAhead = true;
+			else
+			{
+				printf("Critical error - unknown reader %s\n", argv[2]);
+				exit(-1);
+			}
+		}
+		else
+			break;
+		argc -= 2;
+		argv += 2;
+	}
+	if (budget > 0 && threads > 0)
+	{
+		printf("Critical error - -m works on one thread, without -j\n");
+		exit(-1);
+	}
 	int T = atof(argv[1]);
 	int coroutines = atoi(argv[2]);
-	int **sortedFiles = malloc(sizeof(int *) * (argc - 3));
-	char **filenames = malloc(sizeof(char *) * (argc - 3));
+	int files = argc - 3;
 	double workTime[coroutines];
 	int switches[coroutines];
 
-	for (int i = 3; i < argc; i++)
+	int runCount = 0;
+	int **runs = NULL;
+	if (budget > 0)
+	{
+		struct spill *spill = spillSort(T, coroutines, argv + 3, files, budget, workTime, switches);
+		spillMerge("result.txt", spill, budget);
+		spillDelete(spill);
+	}
+	else
 	{
-		filenames[i - 3] = argv[i];
+		runs = sortFiles(threads, T, coroutines, argv + 3, files, workTime, switches, &runCount);
+		struct merger m;
+		mergerCreate(&m, runCount);
+		for (int i = 0; i < runCount; i++)
+			mergerAdd(&m, runs[i] + 1, runs[i] + runs[i][0] + 1);
+		writeFile("result.txt", &m);
+		mergerDestroy(&m);
 	}
 
-	coro_sched_init();
+	double totalWorkTime = clockSeconds() - totalWorkTimeStart;
+	printf("Total work time: %f seconds\n", totalWorkTime);
 	for (int i = 0; i < coroutines; i++)
 	{
-		coro_new(coroutine_func_f, my_context_new(argc - 3, &filenames, &sortedFiles, T / (argc - 2.0), &workTime[i], &switches[i]));
+		printf("Coroutine #%d: \n", i + 1);
+		printf("\tWork Time: %f seconds\n", workTime[i] / 1000000.0);
+		printf("\tSwitches: %d\n", switches[i]);
 	}
 
-	struct coro *c;
-	while ((c = coro_sched_wait()) != NULL)
+	for (int i = 0; i < runCount; i++)
+		free(runs[i]);
+	free(runs);
+
+	return 0;
+}
+
+static int **sortFiles(int threads, int T, int coroutines, char **files, int count, double *workTime, int *switches, int *runCount)
+{
+	int pieces = threads > 1 ? threads : 1;
+	int **sortedFiles = calloc(count * pieces, sizeof(int *));
+	char **filenames = malloc(sizeof(char *) * count);
+	memcpy(filenames, files, sizeof(char *) * count);
+
+	if (threads > 0)
 	{
-		coro_delete(c);
+		if (coro_sched_init_workers(threads) != 0)
+		{
+			printf("Critical error - can't start %d threads\n", threads);
+			exit(-1);
+		}
 	}
-
-	int *sortedArr = mergeSortArrays(sortedFiles, argc - 3);
-	int *writeArr = malloc(sizeof(int) * (sortedArr[0]));
-	for (int i = 0; i < sortedArr[0]; i++)
+	else
+	{
+		coro_sched_init();
+	}
+	struct coro_group *group = coro_group_new();
+	struct coro_attr attr = {.group = group};
+	for (int i = 0; i < coroutines; i++)
 	{
-		writeArr[i] = sortedArr[i + 1];
+		coro_new_ex(coroutine_func_f, my_context_new(count, &filenames, &sortedFiles, T / (count + 1.0), &workTime[i], &switches[i], pieces), &attr);
 	}
-	writeFile("result.txt", writeArr, sortedArr[0]);
 
-	if (argc > 4)
-		free(sortedArr);
-	free(writeArr);
-	for (int i = 0; i < argc - 3; i++)
+	// waits for all the sorters and deletes them
+	coro_group_join(group);
+	coro_group_delete(group);
+
+	// files which were not split leave empty slots
+	int runs = 0;
+	for (int i = 0; i < count * pieces; i++)
+	{
+		if (sortedFiles[i] != NULL)
+			sortedFiles[runs++] = sortedFiles[i];
+	}
+	// the threads merge into one run, otherwise the runs are merged while writing
+	if (threads > 0)
 	{
-		free(sortedFiles[i]);
-		free(filenames[i]);
+		int *sortedArr = mergeRunsParallel(sortedFiles, runs, threads);
+		for (int i = 0; i < runs; i++)
+			free(sortedFiles[i]);
+		sortedFiles[0] = sortedArr;
+		runs = 1;
 	}
+	coro_sched_destroy();
 	free(filenames);
-	free(sortedFiles);
+	*runCount = runs;
+	return sortedFiles;
+}
 
-	struct timespec totalWorkTimeEnd;
-	clock_gettime(CLOCK_MONOTONIC, &totalWorkTimeEnd);
-	double totalWorkTime = 1000000.0 * totalWorkTimeEnd.tv_sec + 1e-3 * totalWorkTimeEnd.tv_nsec - (1000000.0 * totalWorkTimeStart.tv_sec + 1e-3 * totalWorkTimeStart.tv_nsec);
-	printf("Total work time: %f seconds\n", totalWorkTime / 1000000.0);
+static struct spill *spillSort(int T, int coroutines, char **files, int count, long long budget, double *workTime, int *switches)
+{
+	// three quarters of the budget are the coroutine buffers, the rest is left for the allocator and the stacks
+	long long share = budget * 3 / 4 / coroutines;
+	long long chunkSize = share / 8;
+	if (chunkSize > INPUT_CHUNK_SIZE)
+		chunkSize = INPUT_CHUNK_SIZE;
+	// the reader has a chunk parsed and a chunk read ahead, a number takes its place in the run and in the sort buffer
+	long long runSize = (share - 2 * (chunkSize + READER_CARRY_MAX)) / (2 * sizeof(int));
+	if (runSize < SPILL_READ_MIN)
+	{
+		printf("Critical error - the memory budget is too small for %d coroutines\n", coroutines);
+		exit(-1);
+	}
+	if (runSize > INT_MAX)
+		runSize = INT_MAX;
+
+	struct spill *spill = malloc(sizeof(*spill));
+	char path[] = "result.txt.spill-XXXXXX";
+	spill->fd = mkstemp(path);
+	if (spill->fd < 0)
+	{
+		printf("Critical error - can't create a spill file\n");
+		exit(-1);
+	}
+	// the file is removed when closed
+	unlink(path);
+	spill->size = 0;
+	spill->count = 0;
+	spill->capacity = 16;
+	spill->runs = malloc(sizeof(struct spill_run) * spill->capacity);
+
+	char **filenames = malloc(sizeof(char *) * count);
+	memcpy(filenames, files, sizeof(char *) * count);
+	coro_sched_init();
+	struct coro_group *group = coro_group_new();
+	struct coro_attr attr = {.group = group};
 	for (int i = 0; i < coroutines; i++)
 	{
-		printf("Coroutine #%d: \n", i + 1);
-		printf("\tWork Time: %f seconds\n", workTime[i] / 1000000.0);
-		printf("\tSwitches: %d\n", switches[i]);
+		struct spill_context *ctx = malloc(sizeof(*ctx));
+		ctx->files = count;
+		ctx->filenames = filenames;
+		ctx->spill = spill;
+		ctx->runSize = runSize;
+		ctx->chunkSize = chunkSize;
+		ctx->quantum = T / (count + 1.0);
+		ctx->workTime = &workTime[i];
+		ctx->switches = &switches[i];
+		coro_new_ex(spill_func_f, ctx, &attr);
 	}
+	coro_group_join(group);
+	coro_group_delete(group);
+	coro_sched_destroy();
+	free(filenames);
+	return spill;
+}
 
-	return 0;
+static void spillRun(struct spill *spill, int *numbers, int *aux, int size)
+{
+	memcpy(aux, numbers, sizeof(int) * size);
+	sortInto(numbers, aux, size);
+	// the coroutines switch only on yields, so the runs are appended whole
+	if (spill->count == spill->capacity)
+	{
+		spill->capacity *= 2;
+		spill->runs = realloc(spill->runs, sizeof(struct spill_run) * spill->capacity);
+	}
+	spill->runs[spill->count].offset = spill->size;
+	spill->runs[spill->count].count = size;
+	spill->count++;
+	writeAll(spill->fd, (char *)numbers, sizeof(int) * size);
+	spill->size += sizeof(int) * size;
+	// the kernel writes the run back while the others parse and sort
+	coro_yield();
+}
+
+static void spillMerge(char *filename, struct spill *spill, long long budget)
+{
+	// half of the budget is the read buffers of the runs
+	long long bufferSize = budget / 2 / sizeof(int) / (spill->count > 0 ? spill->count : 1);
+	if (bufferSize < SPILL_READ_MIN)
+		bufferSize = SPILL_READ_MIN;
+	if (bufferSize > INPUT_CHUNK_SIZE)
+		bufferSize = INPUT_CHUNK_SIZE;
+	struct merger m;
+	mergerCreate(&m, spill->count);
+	for (int i = 0; i < spill->count; i++)
+		mergerAddFile(&m, spill->fd, spill->runs[i].offset, spill->runs[i].count, bufferSize);
+	writeFile(filename, &m);
+	mergerDestroy(&m);
+}
+
+static void spillDelete(struct spill *spill)
+{
+	close(spill->fd);
+	free(spill->runs);
+	free(spill);
+}
+
+static void sortPieces(int *numbers, int pieces, double quantum, int **runs)
+{
+	int size = numbers[0];
+	struct coro_group *group = coro_group_new();
+	struct coro_attr attr = {.group = group};
+	for (int i = 0; i < pieces; i++)
+	{
+		int begin = (long long)size * i / pieces;
+		int end = (long long)size * (i + 1) / pieces;
+		int *piece = malloc(sizeof(int) * (end - begin + 1));
+		piece[0] = end - begin;
+		memcpy(piece + 1, numbers + begin + 1, sizeof(int) * (end - begin));
+		runs[i] = piece;
+
+		struct piece_context *ctx = malloc(sizeof(*ctx));
+		ctx->numbers = piece;
+		ctx->quantum = quantum;
+		coro_new_ex(piece_func_f, ctx, &attr);
+	}
+	coro_group_join(group);
+	coro_group_delete(group);
+}
+
+static int *mergeRunsParallel(int **runs, int count, int parts)
+{
+	int total = 0;
+	int longest = 0;
+	for (int i = 0; i < count; i++)
+	{
+		total += runs[i][0];
+		if (runs[i][0] > runs[longest][0])
+			longest = i;
+	}
+	int *merged = malloc(sizeof(int) * (total + 1));
+	merged[0] = total;
+	if (count == 0)
+		return merged;
+
+	// part boundaries in every run, split by quantiles of the longest one
+	int *bounds = malloc(sizeof(int) * (parts + 1) * count);
+	for (int i = 0; i < count; i++)
+	{
+		bounds[i] = 0;
+		bounds[parts * count + i] = runs[i][0];
+	}
+	for (int p = 1; p < parts; p++)
+	{
+		int splitter = runs[longest][(long long)runs[longest][0] * p / parts + 1];
+		for (int i = 0; i < count; i++)
+			bounds[p * count + i] = lowerBound(runs[i], splitter);
+	}
+
+	struct coro_group *group = coro_group_new();
+	struct coro_attr attr = {.group = group};
+	int *out = merged + 1;
+	for (int p = 0; p < parts; p++)
+	{
+		struct merge_context *ctx = malloc(sizeof(*ctx));
+		ctx->runs = runs;
+		ctx->count = count;
+		ctx->starts = bounds + p * count;
+		ctx->ends = bounds + (p + 1) * count;
+		ctx->out = out;
+		for (int i = 0; i < count; i++)
+			out += ctx->ends[i] - ctx->starts[i];
+		coro_new_ex(merge_func_f, ctx, &attr);
+	}
+	coro_group_join(group);
+	coro_group_delete(group);
+	free(bounds);
+	return merged;
+}
+
+static int lowerBound(int *run, int value)
+{
+	int left = 0;
+	int right = run[0];
+	while (left < right)
+	{
+		int mid = left + (right - left) / 2;
+		if (run[mid + 1] < value)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	return left;
+}
+
+static void benchParse(int megabytes)
+{
+	// random numbers of all the int range, separated by random whitespace
+	long size = (long)megabytes << 20;
+	char *input = malloc(size + 16);
+	const char separators[] = " \n\t  \r\n";
+	long pos = 0;
+	int count = 0;
+	while (pos < size)
+	{
+		int number = (int)((unsigned)rand() << 16 ^ (unsigned)rand());
+		pos += sprintf(input + pos, "%d%c", number, separators[rand() % (sizeof(separators) - 1)]);
+		count++;
+	}
+	input[pos] = 0;
+
+	double start = clockSeconds();
+	int *numbers = parseNumbers(input, pos);
+	double time = clockSeconds() - start;
+	if (numbers[0] != count)
+	{
+		printf("Critical error - parsed %d numbers of %d\n", numbers[0], count);
+		exit(-1);
+	}
+	printf("parse: %.1f MB, %d numbers, %.3f seconds, %.0f MB/s\n", pos / 1048576.0, count, time, pos / 1048576.0 / time);
+	free(numbers);
+	free(input);
+}
+
+static void benchMerge(void)
+{
+	// the same amount of numbers split into more and more runs
+	int total = 1 << 24;
+	int *numbers = malloc(sizeof(int) * (total + 1024));
+	int *runs[1024];
+	for (int k = 2; k <= 1024; k *= 2)
+	{
+		int *pos = numbers;
+		for (int i = 0; i < k; i++)
+		{
+			int size = total / k;
+			runs[i] = pos;
+			pos[0] = size;
+			int value = rand() % 1024;
+			for (int j = 1; j <= size; j++)
+			{
+				value += rand() % 256;
+				pos[j] = value;
+			}
+			pos += size + 1;
+		}
+		double start = clockSeconds();
+		int *merged = mergeRuns(runs, k);
+		double time = clockSeconds() - start;
+		printf("merge: %4d runs, %d numbers, %.3f seconds, %.2f ns per number\n", k, merged[0], time, time * 1e9 / merged[0]);
+		free(merged);
+	}
+	free(numbers);
 }
 
-static char *readFile(char *filename)
+static void benchSort(void)
 {
-	FILE *fptr = fopen(filename, "r");
+	// like 'generator.py -m', small ranges repeat values, the last one has negatives too
+	const int sizes[] = {1 << 10, 1 << 14, 1 << 18, 1 << 22};
+	const unsigned ranges[] = {1000, 100000, 1u << 31, UINT_MAX};
+	const char *names[] = {"merge", "radix", "simd"};
+	int maxSize = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	int *input = malloc(sizeof(int) * maxSize);
+	int *expected = malloc(sizeof(int) * maxSize);
+	int *data = malloc(sizeof(int) * maxSize);
+	int *aux = malloc(sizeof(int) * maxSize);
+	// no coroutines, the yields return at once
+	coro_sched_init();
+	printf("sort: ns per number, every size sorts %d numbers in total\n", maxSize);
+	printf("%10s %11s %8s %8s %8s\n", "numbers", "range", names[0], names[1], names[2]);
+	for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+	{
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			int size = sizes[s];
+			int repeats = maxSize / size;
+			double times[SORT_SIMD + 1] = {0};
+			srand(s * 16 + r);
+			for (int k = 0; k < repeats; k++)
+			{
+				for (int i = 0; i < size; i++)
+				{
+					unsigned value = (unsigned)rand() << 16 ^ (unsigned)rand() << 1 ^ (unsigned)rand();
+					input[i] = ranges[r] == UINT_MAX ? (int)value : (int)(value % (ranges[r] + 1));
+				}
+				for (int e = SORT_MERGE; e <= SORT_SIMD; e++)
+				{
+					if (e == SORT_SIMD && !simdSupported())
+						continue;
+					sortEngine = e;
+					memcpy(data, input, sizeof(int) * size);
+					memcpy(aux, input, sizeof(int) * size);
+					double start = clockSeconds();
+					sortInto(data, aux, size);
+					times[e] += clockSeconds() - start;
+					// the merge engine is the reference for the others
+					if (e == SORT_MERGE)
+						memcpy(expected, data, sizeof(int) * size);
+					else if (memcmp(expected, data, sizeof(int) * size) != 0)
+					{
+						printf("\nCritical error - %s sort differs from merge sort\n", names[e]);
+						exit(-1);
+					}
+				}
+			}
+			if (ranges[r] == UINT_MAX)
+				printf("%10d %11s", size, "int");
+			else
+				printf("%10d %11u", size, ranges[r]);
+			for (int e = SORT_MERGE; e <= SORT_SIMD; e++)
+			{
+				if (e == SORT_SIMD && !simdSupported())
+					printf(" %8s", "n/a");
+				else
+					printf(" %8.2f", times[e] * 1e9 / maxSize);
+			}
+			printf("\n");
+		}
+	}
+	coro_sched_destroy();
+	sortEngine = SORT_MERGE;
+	free(aux);
+	free(data);
+	free(expected);
+	free(input);
+}
+
+static void benchParallel(int threads, int T, int coroutines, char **files, int count)
+{
+	if (threads < 1)
+	{
+		printf("Critical error - the parallel bench needs at least one thread\n");
+		exit(-1);
+	}
+	double workTime[coroutines];
+	int switches[coroutines];
+	double start = clockSeconds();
+	int parallelCount;
+	int **parallelRuns = sortFiles(threads, T, coroutines, files, count, workTime, switches, &parallelCount);
+	double parallelTime = clockSeconds() - start;
 
-	fseek(fptr, 0L, SEEK_END);
-	int size = ftell(fptr) + 1;
+	start = clockSeconds();
+	int singleCount;
+	int **singleRuns = sortFiles(0, T, coroutines, files, count, workTime, switches, &singleCount);
+	int *singleArr = mergeRuns(singleRuns, singleCount);
+	double singleTime = clockSeconds() - start;
 
-	rewind(fptr);
+	// the parallel result is a single merged run
+	int *sortedArr = parallelRuns[0];
+	if (singleArr[0] != sortedArr[0] || memcmp(singleArr, sortedArr, sizeof(int) * (sortedArr[0] + 1)) != 0)
+	{
+		printf("Critical error - parallel and single-thread results differ\n");
+		exit(-1);
+	}
+	printf("parallel: %d numbers, %f seconds on %d threads, %f seconds on one thread, speed-up %.2f\n",
+		   sortedArr[0], parallelTime, threads, singleTime, singleTime / parallelTime);
+	free(singleArr);
+	for (int i = 0; i < singleCount; i++)
+		free(singleRuns[i]);
+	free(singleRuns);
+	for (int i = 0; i < parallelCount; i++)
+		free(parallelRuns[i]);
+	free(parallelRuns);
+}
+
+static double clockSeconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
 
-	char *fileInput = malloc(sizeof(char) * size);
-	fgets(fileInput, size, fptr);
-	fclose(fptr);
+static char *mapFile(char *filename, size_t *size)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("Critical error - can't open %s\n", filename);
+		exit(-1);
+	}
+	*size = st.st_size;
+	char *fileInput = NULL;
+	// an empty file can't be mapped
+	if (*size > 0)
+	{
+		fileInput = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (fileInput == MAP_FAILED)
+		{
+			printf("Critical error - can't map %s\n", filename);
+			exit(-1);
+		}
+		// read once front to back, the kernel can read ahead more and drop behind
+		madvise(fileInput, *size, MADV_SEQUENTIAL);
+	}
+	close(fd);
 
 	return fileInput;
 }
 
-static int *parseNumbers(char *str)
+static int *readNumbers(char *filename)
 {
-	// get size of array
-	char *strCopy = malloc(sizeof(char) * strlen(str));
-	strcpy(strCopy, str);
+	// parsed by chunks as they come, the array grows twice when full
+	struct number_reader reader;
+	readerCreate(&reader, filename, INPUT_CHUNK_SIZE);
+	int capacity = 1024;
+	int *numbers = malloc(sizeof(int) * (capacity + 1));
 	int size = 0;
-	char *token1 = strtok(strCopy, " ");
-	while (token1 != NULL)
+	int parsed;
+	while ((parsed = readerNext(&reader, numbers + size + 1, capacity - size)) > 0)
 	{
-		token1 = strtok(NULL, " ");
-		size++;
+		size += parsed;
+		if (size == capacity)
+		{
+			capacity *= 2;
+			numbers = realloc(numbers, sizeof(int) * (capacity + 1));
+		}
 	}
+	readerDestroy(&reader);
+	numbers[0] = size;
+	return numbers;
+}
 
-	free(strCopy);
-
-	int i = 1;
-	int *numbers = malloc(sizeof(int) * (size + 1));
+static int *parseNumbers(const char *str, size_t length)
+{
+	// one pass, the array grows twice when full
+	int capacity = 1024;
+	int *numbers = malloc(sizeof(int) * (capacity + 1));
+	int size = 0;
+	// a mapped file is not zero-terminated
+	const char *pos = str;
+	const char *end = str + length;
+	while (true)
+	{
+		int parsed;
+		pos = parseRange(pos, end, numbers + size + 1, capacity - size, &parsed);
+		size += parsed;
+		if (pos == end)
+			break;
+		capacity *= 2;
+		numbers = realloc(numbers, sizeof(int) * (capacity + 1));
+	}
 	numbers[0] = size;
-	char *token2 = strtok(str, " ");
-	while (token2 != NULL)
+	return numbers;
+}
+
+static int *decodeNumbers(const char *data, size_t length, char *filename)
+{
+	if (inputFormat == FORMAT_TEXT)
+		return parseNumbers(data, length);
+	if (length % sizeof(int) != 0)
 	{
-		numbers[i] = atoi(token2);
-		token2 = strtok(NULL, " ");
-		i++;
+		printf("Critical error - %s is not a whole number of int32\n", filename);
+		exit(-1);
 	}
+	int count = length / sizeof(int);
+	int *numbers = malloc(sizeof(int) * (count + 1));
+	numbers[0] = count;
+	decodeRaw(data, numbers + 1, count);
 	return numbers;
 }
 
-static void writeFile(char *filename, int *numbers, int size)
+static void decodeRaw(const char *data, int *out, int count)
 {
-	FILE *fptr = fopen(filename, "w");
-	for (int i = 0; i < size; i++)
+	memcpy(out, data, sizeof(int) * count);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (int i = 0; i < count; i++)
+		out[i] = __builtin_bswap32(out[i]);
+#endif
+}
+
+static inline bool isSpace(unsigned char c)
+{
+	// ' ' and '\t', '\n', '\v', '\f', '\r'
+	return c == ' ' || (unsigned)(c - '\t') <= '\r' - '\t';
+}
+
+static const char *parseRange(const char *str, const char *end, int *out, int max, int *count)
+{
+	const unsigned char *pos = (const unsigned char *)str;
+	int size = 0;
+	while (true)
 	{
-		fprintf(fptr, "%d ", numbers[i]);
+		while (pos < (const unsigned char *)end && isSpace(*pos))
+			pos++;
+		if (pos == (const unsigned char *)end || size == max)
+			break;
+		bool isNegative = *pos == '-';
+		pos += isNegative;
+		const unsigned char *digits = pos;
+		// unsigned, so that INT_MIN does not overflow
+		unsigned value = 0;
+		unsigned digit;
+		while (pos < (const unsigned char *)end && (digit = *pos - '0') < 10)
+		{
+			value = value * 10 + digit;
+			pos++;
+		}
+		if (pos == digits)
+		{
+			// not a number, skip the character, unless it was a lone '-'
+			pos += !isNegative;
+			continue;
+		}
+		out[size++] = isNegative ? (int)(0u - value) : (int)value;
+	}
+	*count = size;
+	return (const char *)pos;
+}
+
+static void readerCreate(struct number_reader *r, char *filename, int bufferSize)
+{
+	r->fd = open(filename, O_RDONLY);
+	if (r->fd < 0)
+	{
+		printf("Critical error - can't open %s\n", filename);
+		exit(-1);
+	}
+	posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	r->filename = filename;
+	r->buffer = malloc(READER_CARRY_MAX + bufferSize);
+	r->ahead = malloc(READER_CARRY_MAX + bufferSize);
+	r->bufferSize = bufferSize;
+	r->pos = r->buffer + READER_CARRY_MAX;
+	r->end = r->pos;
+	r->parseEnd = r->pos;
+	r->offset = 0;
+	r->isEof = false;
+	coro_aio_pread(&r->read, r->fd, r->ahead + READER_CARRY_MAX, bufferSize, 0);
+	r->isReading = true;
+}
+
+static void readerFill(struct number_reader *r)
+{
+	// the other coroutines run until the chunk is read
+	ssize_t got = coro_aio_wait(&r->read);
+	r->isReading = false;
+	if (got < 0)
+	{
+		printf("Critical error - can't read %s\n", r->filename);
+		exit(-1);
+	}
+	// a number cut by the end of the previous chunk goes right before the new one
+	size_t tail = r->end - r->pos;
+	char *chunk = r->ahead + READER_CARRY_MAX;
+	memcpy(chunk - tail, r->pos, tail);
+	r->ahead = r->buffer;
+	r->buffer = chunk - READER_CARRY_MAX;
+	r->pos = chunk - tail;
+	r->end = chunk + got;
+	r->offset += got;
+	if (got == 0)
+	{
+		if (inputFormat == FORMAT_RAW && tail != 0)
+		{
+			printf("Critical error - %s is not a whole number of int32\n", r->filename);
+			exit(-1);
+		}
+		r->isEof = true;
+		r->parseEnd = r->end;
+		return;
+	}
+	// the next chunk is read while this one is parsed
+	coro_aio_pread(&r->read, r->fd, r->ahead + READER_CARRY_MAX, r->bufferSize, r->offset);
+	r->isReading = true;
+	if (inputFormat == FORMAT_RAW)
+	{
+		// a number cut by the end of the chunk waits for the next one
+		r->parseEnd = r->pos + (r->end - r->pos) / sizeof(int) * sizeof(int);
+		return;
 	}
-	fclose(fptr);
+	// the numbers up to the last whitespace are complete
+	char *last = r->end;
+	while (last > r->pos && !isSpace(last[-1]))
+		last--;
+	// a token longer than the carry is cut anyway
+	r->parseEnd = r->end - last <= READER_CARRY_MAX ? last : r->end;
 }
 
-static int *merge(int *a, int *b)
+static int readerNext(struct number_reader *r, int *out, int max)
 {
-	int sizeA = a[0];
-	int sizeB = b[0];
-	int *merged = malloc(sizeof(int) * (sizeA + sizeB + 1));
-	merged[0] = sizeA + sizeB;
-	int i = 1;
-	int j = 1;
-	int k = 1;
-	while (i <= sizeA && j <= sizeB)
+	int count = 0;
+	while (count < max)
+	{
+		int parsed;
+		if (inputFormat == FORMAT_RAW)
+		{
+			parsed = (r->parseEnd - r->pos) / sizeof(int);
+			if (parsed > max - count)
+				parsed = max - count;
+			decodeRaw(r->pos, out + count, parsed);
+			r->pos += sizeof(int) * parsed;
+		}
+		else
+		{
+			r->pos = (char *)parseRange(r->pos, r->parseEnd, out + count, max - count, &parsed);
+		}
+		count += parsed;
+		if (count == max || r->isEof)
+			break;
+		readerFill(r);
+	}
+	return count;
+}
+
+static void readerDestroy(struct number_reader *r)
+{
+	// the buffer can't be freed under a read
+	if (r->isReading)
+		coro_aio_wait(&r->read);
+	close(r->fd);
+	free(r->ahead);
+	free(r->buffer);
+}
+
+static void writeFile(char *filename, struct merger *m)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		printf("Critical error - can't create %s\n", filename);
+		exit(-1);
+	}
+	// the same text as fprintf("%d ") per number, formatted by hand
+	char *buffer = malloc(OUTPUT_BUFFER_SIZE);
+	char *pos = buffer;
+	int block[MERGE_BLOCK_SIZE];
+	int size;
+	// the numbers come sorted, so the differences fit unsigned, modulo 2^32 for the first one
+	unsigned previous = 0;
+	while ((size = mergerNext(m, block, MERGE_BLOCK_SIZE)) > 0)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			if (pos > buffer + OUTPUT_BUFFER_SIZE - NUMBER_TEXT_MAX)
+			{
+				writeAll(fd, buffer, pos - buffer);
+				pos = buffer;
+			}
+			switch (outputFormat)
+			{
+			case FORMAT_RAW:
+			{
+				uint32_t value = block[i];
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+				value = __builtin_bswap32(value);
+#endif
+				memcpy(pos, &value, sizeof(value));
+				pos += sizeof(value);
+				break;
+			}
+			case FORMAT_DELTA:
+				pos = encodeVarint((unsigned)block[i] - previous, pos);
+				previous = block[i];
+				break;
+			default:
+				pos = formatNumber(block[i], pos);
+				*pos++ = ' ';
+				break;
+			}
+		}
+	}
+	writeAll(fd, buffer, pos - buffer);
+	free(buffer);
+	close(fd);
+}
+
+static char *formatNumber(int number, char *out)
+{
+	static const char digitPairs[] =
+		"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+		"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+		"8081828384858687888990919293949596979899";
+	// unsigned, so that INT_MIN can be negated
+	unsigned value = number;
+	if (number < 0)
+	{
+		*out++ = '-';
+		value = 0u - value;
+	}
+	// digits are written from the end, two at a time
+	char digits[10];
+	char *pos = digits + sizeof(digits);
+	while (value >= 100)
+	{
+		unsigned pair = value % 100 * 2;
+		value /= 100;
+		pos -= 2;
+		pos[0] = digitPairs[pair];
+		pos[1] = digitPairs[pair + 1];
+	}
+	if (value >= 10)
+	{
+		pos -= 2;
+		pos[0] = digitPairs[value * 2];
+		pos[1] = digitPairs[value * 2 + 1];
+	}
+	else
+	{
+		*--pos = '0' + value;
+	}
+	int length = digits + sizeof(digits) - pos;
+	memcpy(out, pos, length);
+	return out + length;
+}
+
+static char *encodeVarint(unsigned value, char *out)
+{
+	// seven bits per byte from the lowest, the high bit marks that more follow
+	while (value >= 0x80)
+	{
+		*out++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (char)value;
+	return out;
+}
+
+static void writeAll(int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = write(fd, data, size);
+		if (written < 0)
+		{
+			printf("Critical error - can't write the result\n");
+			exit(-1);
+		}
+		data += written;
+		size -= written;
+	}
+}
+
+static void mergeRange(int *a, int sizeA, int *b, int sizeB, int *merged)
+{
+	int i = 0;
+	int j = 0;
+	int k = 0;
+	while (i < sizeA && j < sizeB)
 	{
 		if (a[i] < b[j])
 		{
@@ -224,100 +1313,462 @@ static int *merge(int *a, int *b)
 		}
 		k++;
 	}
-	while (i <= sizeA)
+	memcpy(merged + k, a + i, sizeof(int) * (sizeA - i));
+	k += sizeA - i;
+	memcpy(merged + k, b + j, sizeof(int) * (sizeB - j));
+}
+
+static int *mergeSort(int *numbers)
+{
+	int size = numbers[0];
+	if (size < 2)
 	{
-		merged[k] = a[i];
-		i++;
-		k++;
+		return numbers;
 	}
-	while (j <= sizeB)
+	// the only allocation, the levels merge back and forth between the buffers
+	int *aux = malloc(sizeof(int) * size);
+	memcpy(aux, numbers + 1, sizeof(int) * size);
+	sortInto(numbers + 1, aux, size);
+	free(aux);
+	return numbers;
+}
+
+static void mergeSortInto(int *data, int *aux, int size)
+{
+	if (size <= INSERTION_SORT_MAX)
 	{
-		merged[k] = b[j];
-		j++;
-		k++;
+		for (int i = 1; i < size; i++)
+		{
+			int value = data[i];
+			int j = i;
+			for (; j > 0 && data[j - 1] > value; j--)
+				data[j] = data[j - 1];
+			data[j] = value;
+		}
+		return;
 	}
-	return merged;
+	// the halves are sorted in aux using data as their buffer, then merged into data
+	int mid = size / 2;
+	mergeSortInto(aux, data, mid);
+	mergeSortInto(aux + mid, data + mid, size - mid);
+	mergeRange(aux, mid, aux + mid, size - mid, data);
+
+	coro_yield_if_expired(); // yield if the quantum is over
 }
 
-static int *mergeSort(int *numbers, void *context)
+static void sortInto(int *data, int *aux, int size)
 {
-	struct my_context *ctx = context;
-	double *workTime = ctx->workTime;
-	int size = numbers[0];
-	if (size == 1)
+	switch (sortEngine)
 	{
-		return numbers;
+	case SORT_RADIX:
+		radixSortInto(data, aux, size);
+		break;
+	case SORT_SIMD:
+		simdSortInto(data, aux, size);
+		break;
+	default:
+		mergeSortInto(data, aux, size);
+		break;
 	}
-	else
+}
+
+static void radixSortInto(int *data, int *aux, int size)
+{
+	if (size < RADIX_SORT_MIN)
+	{
+		mergeSortInto(data, aux, size);
+		return;
+	}
+	// the counts of all the digits are taken in one read, the sign bit is flipped to order negatives first
+	int counts[RADIX_DIGITS][RADIX_BUCKETS];
+	memset(counts, 0, sizeof(counts));
+	for (int i = 0; i < size; i++)
+	{
+		unsigned key = (unsigned)data[i] ^ 0x80000000u;
+		for (int d = 0; d < RADIX_DIGITS; d++)
+			counts[d][key >> (d * RADIX_BITS) & (RADIX_BUCKETS - 1)]++;
+	}
+	coro_yield_if_expired();
+
+	int *src = data;
+	int *dst = aux;
+	for (int d = 0; d < RADIX_DIGITS; d++)
 	{
-		int mid = size / 2;
-		int *left = malloc(sizeof(int) * (mid + 1));
-		int *right = malloc(sizeof(int) * (size - mid + 1));
-		left[0] = mid;
-		right[0] = size - mid;
-		for (int i = 1; i <= mid; i++)
+		int shift = d * RADIX_BITS;
+		// a digit which is the same in all the numbers would not move them
+		if (counts[d][((unsigned)src[0] ^ 0x80000000u) >> shift & (RADIX_BUCKETS - 1)] == size)
+			continue;
+		int offsets[RADIX_BUCKETS];
+		int sum = 0;
+		for (int b = 0; b < RADIX_BUCKETS; b++)
 		{
-			left[i] = numbers[i];
+			offsets[b] = sum;
+			sum += counts[d][b];
 		}
-		for (int i = mid + 1; i <= size; i++)
+		for (int begin = 0; begin < size; begin += SORT_YIELD_BLOCK)
 		{
-			right[i - mid] = numbers[i];
+			int end = begin + SORT_YIELD_BLOCK < size ? begin + SORT_YIELD_BLOCK : size;
+			for (int i = begin; i < end; i++)
+			{
+				unsigned key = (unsigned)src[i] ^ 0x80000000u;
+				dst[offsets[key >> shift & (RADIX_BUCKETS - 1)]++] = src[i];
+			}
+			coro_yield_if_expired(); // yield if the quantum is over
 		}
-		int *sortedLeft = mergeSort(left, ctx);
-		int *sortedRight = mergeSort(right, ctx);
-		int *sorted = merge(sortedLeft, sortedRight);
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != data)
+		memcpy(data, src, sizeof(int) * size);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static bool simdSupported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+// a comparator of the sorting networks on all the eight lanes at once
+#define SIMD_MIN_MAX(a, b)                      \
+	do                                          \
+	{                                           \
+		__m256i min_ = _mm256_min_epi32(a, b); \
+		b = _mm256_max_epi32(a, b);            \
+		a = min_;                              \
+	} while (0)
+
+// sort a bitonic vector: compare-exchange at distance 4, 2 and 1
+__attribute__((target("avx2"))) static inline __m256i simdBitonic8(__m256i v)
+{
+	__m256i t = _mm256_permute2x128_si256(v, v, 0x01);
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xF0);
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xCC);
+	t = _mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+	v = _mm256_blend_epi32(_mm256_min_epi32(v, t), _mm256_max_epi32(v, t), 0xAA);
+	return v;
+}
+
+// merge two sorted vectors, the smaller half goes to lo and the bigger to hi
+__attribute__((target("avx2"))) static inline void simdMerge16(__m256i *lo, __m256i *hi)
+{
+	// lo followed by reversed hi is bitonic, its min and max halves are bitonic too
+	__m256i reversed = _mm256_permutevar8x32_epi32(*hi, _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+	__m256i min = _mm256_min_epi32(*lo, reversed);
+	__m256i max = _mm256_max_epi32(*lo, reversed);
+	*lo = simdBitonic8(min);
+	*hi = simdBitonic8(max);
+}
 
-		free(left);
-		free(right);
-		if (mid > 1)
-			free(sortedLeft);
-		if (size - mid > 1)
-			free(sortedRight);
+__attribute__((target("avx2"))) static void simdSortBlock(int *block)
+{
+	__m256i r[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i++)
+		r[i] = _mm256_loadu_si256((__m256i *)(block + i * SIMD_WIDTH));
+	// the 19 comparators of the optimal 8-input network sort the columns
+	SIMD_MIN_MAX(r[0], r[2]);
+	SIMD_MIN_MAX(r[1], r[3]);
+	SIMD_MIN_MAX(r[4], r[6]);
+	SIMD_MIN_MAX(r[5], r[7]);
+	SIMD_MIN_MAX(r[0], r[4]);
+	SIMD_MIN_MAX(r[1], r[5]);
+	SIMD_MIN_MAX(r[2], r[6]);
+	SIMD_MIN_MAX(r[3], r[7]);
+	SIMD_MIN_MAX(r[0], r[1]);
+	SIMD_MIN_MAX(r[2], r[3]);
+	SIMD_MIN_MAX(r[4], r[5]);
+	SIMD_MIN_MAX(r[6], r[7]);
+	SIMD_MIN_MAX(r[2], r[4]);
+	SIMD_MIN_MAX(r[3], r[5]);
+	SIMD_MIN_MAX(r[1], r[4]);
+	SIMD_MIN_MAX(r[3], r[6]);
+	SIMD_MIN_MAX(r[1], r[2]);
+	SIMD_MIN_MAX(r[3], r[4]);
+	SIMD_MIN_MAX(r[5], r[6]);
+	// transposed, every row is a sorted run of eight
+	__m256i t[SIMD_WIDTH];
+	for (int i = 0; i < SIMD_WIDTH; i += 2)
+	{
+		t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+		t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+	}
+	for (int i = 0; i < SIMD_WIDTH; i += 4)
+	{
+		r[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+		r[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+		r[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+		r[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		_mm256_storeu_si256((__m256i *)(block + i * SIMD_WIDTH), _mm256_permute2x128_si256(r[i], r[i + 4], 0x20));
+		_mm256_storeu_si256((__m256i *)(block + (i + 4) * SIMD_WIDTH), _mm256_permute2x128_si256(r[i], r[i + 4], 0x31));
+	}
+}
 
-		struct timespec end;
-		clock_gettime(CLOCK_MONOTONIC, &end);
-		double x = 1000000.0 * end.tv_sec + 1e-3 * end.tv_nsec - (1000000.0 * ctx->start.tv_sec + 1e-3 * ctx->start.tv_nsec);
-		if (x > ctx->quantum) // check if time elapsed is greater than quantum
+__attribute__((target("avx2"))) static void simdMerge(int *a, int sizeA, int *b, int sizeB, int *merged)
+{
+	if (sizeA < SIMD_WIDTH || sizeB < SIMD_WIDTH)
+	{
+		mergeRange(a, sizeA, b, sizeB, merged);
+		return;
+	}
+	__m256i lo = _mm256_loadu_si256((__m256i *)a);
+	__m256i hi = _mm256_loadu_si256((__m256i *)b);
+	int i = SIMD_WIDTH;
+	int j = SIMD_WIDTH;
+	for (;;)
+	{
+		simdMerge16(&lo, &hi);
+		_mm256_storeu_si256((__m256i *)merged, lo);
+		merged += SIMD_WIDTH;
+		// hi is kept, the next eight come from the run with the smaller head
+		int *next;
+		if (j == sizeB || (i < sizeA && a[i] < b[j]))
+		{
+			if (sizeA - i < SIMD_WIDTH)
+				break;
+			next = a + i;
+			i += SIMD_WIDTH;
+		}
+		else
 		{
-			*workTime += x;
-			// yield and restart timer
-			coro_yield();
-			clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+			if (sizeB - j < SIMD_WIDTH)
+				break;
+			next = b + j;
+			j += SIMD_WIDTH;
 		}
-		return sorted;
+		lo = _mm256_loadu_si256((__m256i *)next);
+	}
+	// the kept eight are merged with the shorter rest, which is under eight, then with the longer one
+	int kept[SIMD_WIDTH];
+	int tail[2 * SIMD_WIDTH];
+	_mm256_storeu_si256((__m256i *)kept, hi);
+	if (sizeA - i > sizeB - j)
+	{
+		mergeRange(kept, SIMD_WIDTH, b + j, sizeB - j, tail);
+		mergeRange(tail, SIMD_WIDTH + sizeB - j, a + i, sizeA - i, merged);
+	}
+	else
+	{
+		mergeRange(kept, SIMD_WIDTH, a + i, sizeA - i, tail);
+		mergeRange(tail, SIMD_WIDTH + sizeA - i, b + j, sizeB - j, merged);
 	}
-	return NULL;
 }
 
-static int *mergeSortArrays(int **arrays, int size)
+static void simdSortInto(int *data, int *aux, int size)
 {
-	if (size == 1)
+	int blocks = size / SIMD_BLOCK_SIZE * SIMD_BLOCK_SIZE;
+	if (blocks == 0)
 	{
-		return arrays[0];
+		mergeSortInto(data, aux, size);
+		return;
 	}
-	else
+	for (int i = 0; i < blocks; i += SIMD_BLOCK_SIZE)
+	{
+		simdSortBlock(data + i);
+		if (i % SORT_YIELD_BLOCK == 0)
+			coro_yield_if_expired();
+	}
+	// the tail is sorted whole, any eight of it in a row are a sorted run too
+	mergeSortInto(data + blocks, aux + blocks, size - blocks);
+
+	// bottom-up passes double the runs, moving between the buffers
+	int *src = data;
+	int *dst = aux;
+	for (int width = SIMD_WIDTH; width < size; width *= 2)
 	{
-		int mid = size / 2;
-		int **left = malloc(sizeof(int *) * mid);
-		int **right = malloc(sizeof(int *) * (size - mid));
-		for (int i = 0; i < mid; i++)
+		for (int begin = 0; begin < size; begin += 2 * width)
 		{
-			left[i] = arrays[i];
+			int sizeA = size - begin < width ? size - begin : width;
+			int sizeB = size - begin - sizeA < width ? size - begin - sizeA : width;
+			simdMerge(src + begin, sizeA, src + begin + sizeA, sizeB, dst + begin);
+			coro_yield_if_expired(); // yield if the quantum is over
 		}
-		for (int i = mid; i < size; i++)
+		int *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != data)
+		memcpy(data, src, sizeof(int) * size);
+}
+
+#else
+
+static bool simdSupported(void)
+{
+	return false;
+}
+
+static void simdSortInto(int *data, int *aux, int size)
+{
+	mergeSortInto(data, aux, size);
+}
+
+#endif
+
+static void mergerCreate(struct merger *m, int capacity)
+{
+	m->capacity = 1;
+	while (m->capacity < capacity)
+		m->capacity *= 2;
+	m->runs = malloc(sizeof(struct merge_run) * m->capacity);
+	m->tree = malloc(sizeof(uint64_t) * m->capacity);
+	m->count = 0;
+	m->live = 0;
+	m->isBuilt = false;
+}
+
+static void mergerAdd(struct merger *m, int *begin, int *end)
+{
+	struct merge_run *r = &m->runs[m->count++];
+	r->pos = begin;
+	r->end = end;
+	r->fd = -1;
+	r->left = 0;
+	r->buffer = NULL;
+	m->live += begin < end;
+}
+
+static void mergerAddFile(struct merger *m, int fd, off_t offset, long long count, int bufferSize)
+{
+	struct merge_run *r = &m->runs[m->count++];
+	r->buffer = malloc(sizeof(int) * bufferSize);
+	r->bufferSize = bufferSize;
+	r->pos = r->buffer;
+	r->end = r->buffer;
+	r->fd = fd;
+	r->offset = offset;
+	r->left = count;
+	m->live += count > 0;
+}
+
+// read the next part of a run from its file, false if it is over
+static bool mergerRefill(struct merge_run *r)
+{
+	if (r->left == 0)
+		return false;
+	int count = r->left < r->bufferSize ? r->left : r->bufferSize;
+	size_t size = sizeof(int) * count;
+	char *data = (char *)r->buffer;
+	while (size > 0)
+	{
+		ssize_t got = pread(r->fd, data, size, r->offset);
+		if (got <= 0)
+		{
+			printf("Critical error - can't read a spilled run\n");
+			exit(-1);
+		}
+		data += got;
+		size -= got;
+		r->offset += got;
+	}
+	r->pos = r->buffer;
+	r->end = r->buffer + count;
+	r->left -= count;
+	// the kernel reads the next part while this one is merged
+	if (r->left > 0)
+		posix_fadvise(r->fd, r->offset, sizeof(int) * (r->left < r->bufferSize ? r->left : r->bufferSize), POSIX_FADV_WILLNEED);
+	return true;
+}
+
+// the node of the next number of a run, which is taken
+static inline uint64_t mergerTake(struct merger *m, int run)
+{
+	struct merge_run *r = &m->runs[run];
+	if (r->pos == r->end && !mergerRefill(r))
+		return MERGE_NODE_END;
+	return (uint64_t)((uint32_t)*r->pos++ ^ 0x80000000u) << 32 | (uint32_t)run;
+}
+
+static inline int mergerNumber(uint64_t node)
+{
+	return (int)((uint32_t)(node >> 32) ^ 0x80000000u);
+}
+
+// play all the matches from the leaves, which are the first numbers of the runs
+static void mergerBuild(struct merger *m)
+{
+	int capacity = m->capacity;
+	uint64_t *winners = malloc(sizeof(uint64_t) * 2 * capacity);
+	for (int i = 0; i < capacity; i++)
+		winners[capacity + i] = i < m->count ? mergerTake(m, i) : MERGE_NODE_END;
+	for (int i = capacity - 1; i > 0; i--)
+	{
+		uint64_t left = winners[2 * i];
+		uint64_t right = winners[2 * i + 1];
+		winners[i] = left < right ? left : right;
+		m->tree[i] = left < right ? right : left;
+	}
+	m->tree[0] = winners[1];
+	free(winners);
+	m->isBuilt = true;
+}
+
+static int mergerNext(struct merger *m, int *out, int max)
+{
+	if (!m->isBuilt)
+		mergerBuild(m);
+	uint64_t *tree = m->tree;
+	int count = 0;
+	while (count < max && m->live > 1)
+	{
+		uint64_t winner = tree[0];
+		int run = (uint32_t)winner;
+		out[count++] = mergerNumber(winner);
+		winner = mergerTake(m, run);
+		m->live -= winner == MERGE_NODE_END;
+		// replay the matches on the path of the run, one branchless comparison per level
+		for (int i = (run + m->capacity) / 2; i > 0; i /= 2)
 		{
-			right[i - mid] = arrays[i];
+			uint64_t node = tree[i];
+			uint64_t min = node < winner ? node : winner;
+			tree[i] = node ^ winner ^ min;
+			winner = min;
 		}
-		int *sortedLeft = mergeSortArrays(left, mid);
-		int *sortedRight = mergeSortArrays(right, size - mid);
-		int *sorted = merge(sortedLeft, sortedRight);
-		free(left);
-		free(right);
-		if (mid > 1)
-			free(sortedLeft);
-		if (size - mid > 1)
-			free(sortedRight);
-		return sorted;
+		tree[0] = winner;
+	}
+	// the last run is copied as is, it is the winner
+	while (count < max && m->live == 1)
+	{
+		int run = (uint32_t)tree[0];
+		struct merge_run *r = &m->runs[run];
+		out[count++] = mergerNumber(tree[0]);
+		int tail = r->end - r->pos;
+		if (tail > max - count)
+			tail = max - count;
+		memcpy(out + count, r->pos, sizeof(int) * tail);
+		count += tail;
+		r->pos += tail;
+		tree[0] = mergerTake(m, run);
+		m->live -= tree[0] == MERGE_NODE_END;
 	}
-	return NULL;
-}
\ No newline at end of file
+	return count;
+}
+
+static void mergerDestroy(struct merger *m)
+{
+	for (int i = 0; i < m->count; i++)
+		free(m->runs[i].buffer);
+	free(m->runs);
+	free(m->tree);
+}
+
+static int *mergeRuns(int **runs, int count)
+{
+	struct merger m;
+	mergerCreate(&m, count);
+	int total = 0;
+	for (int i = 0; i < count; i++)
+	{
+		mergerAdd(&m, runs[i] + 1, runs[i] + runs[i][0] + 1);
+		total += runs[i][0];
+	}
+	int *merged = malloc(sizeof(int) * (total + 1));
+	merged[0] = total;
+	mergerNext(&m, merged + 1, total);
+	mergerDestroy(&m);
+	return merged;
+}
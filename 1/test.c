@@ -0,0 +1,1614 @@
+#include "libcoro.h"
+#include "coro_io.h"
+#include "coro_chan.h"
+#include "unit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+static int
+test_basic_f(void *arg)
+{
+	int *counter = arg;
+	for (int i = 0; i < 10; ++i) {
+		++*counter;
+		coro_yield();
+	}
+	return *counter;
+}
+
+static void
+test_basic(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int counter = 0;
+	struct coro *c1 = coro_new(test_basic_f, &counter);
+	struct coro *c2 = coro_new(test_basic_f, &counter);
+	unit_check(!coro_is_finished(c1) && !coro_is_finished(c2),
+		   "new coroutines are not finished");
+	unit_check(counter == 0, "new coroutines are not started");
+
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(c != c1 && c != c2);
+		unit_fail_if(!coro_is_finished(c));
+		unit_fail_if(coro_switch_count(c) < 10);
+		++finished;
+		coro_delete(c);
+	}
+	unit_check(finished == 2, "both coroutines are returned by wait");
+	unit_check(counter == 20, "both coroutines did all their work");
+
+	unit_test_finish();
+}
+
+static int
+test_status_f(void *arg)
+{
+	int depth = *(int *)arg;
+	/*
+	 * Use some stack and registers across the yields to see
+	 * that they are preserved by the switch.
+	 */
+	volatile long long sum = 0;
+	char buf[1024];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = (char)(i + depth);
+	for (int i = 0; i < depth; ++i) {
+		sum += i;
+		coro_yield();
+	}
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		unit_fail_if(buf[i] != (char)(i + depth));
+	return (int)(sum == (long long)depth * (depth - 1) / 2) + depth;
+}
+
+static void
+test_status(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int depths[] = {1, 5, 100, 3000};
+	int count = sizeof(depths) / sizeof(depths[0]);
+	struct coro *coros[count];
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(test_status_f, &depths[i]);
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		++finished;
+	unit_check(finished == count, "all coroutines are finished");
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		ok = ok && coro_status(coros[i]) == depths[i] + 1;
+		coro_delete(coros[i]);
+	}
+	unit_check(ok, "return values and local state are preserved");
+
+	unit_test_finish();
+}
+
+static double
+test_fp_f_helper(double x)
+{
+	coro_yield();
+	return x * 1.5;
+}
+
+static int
+test_fp_f(void *arg)
+{
+	double *res = arg;
+	double v = 1;
+	for (int i = 0; i < 20; ++i)
+		v = test_fp_f_helper(v);
+	*res = v;
+	return 0;
+}
+
+static void
+test_fp(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	double r1 = 0, r2 = 0;
+	coro_new(test_fp_f, &r1);
+	coro_new(test_fp_f, &r2);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	double expected = 1;
+	for (int i = 0; i < 20; ++i)
+		expected *= 1.5;
+	unit_check(r1 == expected && r2 == expected,
+		   "floating point state survives the switches");
+
+	unit_test_finish();
+}
+
+struct test_order_ctx {
+	int id;
+	int *log;
+	int *log_size;
+};
+
+static int
+test_order_f(void *arg)
+{
+	struct test_order_ctx *ctx = arg;
+	for (int i = 0; i < 3; ++i) {
+		ctx->log[(*ctx->log_size)++] = ctx->id;
+		coro_yield();
+	}
+	return 0;
+}
+
+static void
+test_round_robin(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int log[9];
+	int log_size = 0;
+	struct test_order_ctx ctx[3];
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i) {
+		ctx[i].id = i;
+		ctx[i].log = log;
+		ctx[i].log_size = &log_size;
+		coros[i] = coro_new(test_order_f, &ctx[i]);
+	}
+	bool ok = true;
+	for (int i = 0; i < 3; ++i)
+		ok = ok && coro_sched_wait() == coros[i];
+	unit_check(ok, "coroutines finish in the order of creation");
+	unit_check(coro_sched_wait() == NULL, "no more coroutines");
+	for (int i = 0; i < 3; ++i)
+		coro_delete(coros[i]);
+	ok = log_size == 9;
+	for (int i = 0; i < log_size; ++i)
+		ok = ok && log[i] == i % 3;
+	unit_check(ok, "yield is round-robin");
+
+	unit_test_finish();
+}
+
+struct test_event {
+	bool is_set;
+	struct coro *waiter;
+};
+
+static int
+test_event_wait_f(void *arg)
+{
+	struct test_event *e = arg;
+	while (!e->is_set) {
+		e->waiter = coro_this();
+		coro_suspend();
+	}
+	return 0;
+}
+
+static int
+test_event_set_f(void *arg)
+{
+	struct test_event *e = arg;
+	for (int i = 0; i < 100; ++i)
+		coro_yield();
+	e->is_set = true;
+	coro_wakeup(e->waiter);
+	return 0;
+}
+
+static void
+test_suspend(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct test_event e = {false, NULL};
+	struct coro *waiter = coro_new(test_event_wait_f, &e);
+	struct coro *setter = coro_new(test_event_set_f, &e);
+	unit_check(coro_sched_wait() == setter, "the setter finished first");
+	unit_check(coro_sched_wait() == waiter, "the waiter is woken up");
+	unit_check(coro_switch_count(waiter) == 1,
+		   "the suspended coroutine was not scheduled");
+	coro_delete(waiter);
+	coro_delete(setter);
+
+	e.is_set = false;
+	waiter = coro_new(test_event_wait_f, &e);
+	unit_check(coro_sched_wait() == NULL,
+		   "wait returns NULL when all are suspended");
+	unit_check(!coro_is_finished(waiter), "the waiter is not finished");
+	e.is_set = true;
+	coro_wakeup(waiter);
+	coro_wakeup(waiter);
+	unit_check(coro_sched_wait() == waiter,
+		   "wakeup from the scheduler works, twice is fine");
+	unit_check(coro_sched_wait() == NULL, "no more coroutines");
+	coro_delete(waiter);
+
+	unit_test_finish();
+}
+
+static int
+test_io_reader_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[16];
+	size_t total = 0;
+	while (total < 10) {
+		ssize_t rc = coro_read(fd, buf, sizeof(buf));
+		if (rc <= 0)
+			return -1;
+		total += rc;
+	}
+	return total;
+}
+
+static int
+test_io_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < 10; ++i) {
+		for (int j = 0; j < 10; ++j)
+			coro_yield();
+		if (coro_write_all(fd, "x", 1) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static void *
+test_io_thread_f(void *arg)
+{
+	int fd = *(int *)arg;
+	for (int i = 0; i < 10; ++i) {
+		usleep(1000);
+		if (write(fd, "x", 1) != 1)
+			return NULL;
+	}
+	return NULL;
+}
+
+static void
+test_io_pipe(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	unit_fail_if(fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0);
+	unit_fail_if(fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0);
+	struct coro *reader = coro_new(test_io_reader_f, &fds[0]);
+	struct coro *writer = coro_new(test_io_writer_f, &fds[1]);
+	unit_check(coro_sched_wait() == writer, "the writer finished");
+	unit_check(coro_sched_wait() == reader, "the reader finished");
+	unit_check(coro_status(reader) == 10 && coro_status(writer) == 0,
+		   "all the data is transferred");
+	unit_check(coro_switch_count(reader) <= 11,
+		   "the reader was not busy polling");
+	coro_delete(reader);
+	coro_delete(writer);
+	/*
+	 * The scheduler sleeps in epoll when the only coroutine
+	 * waits for data, until another thread writes it.
+	 */
+	reader = coro_new(test_io_reader_f, &fds[0]);
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, test_io_thread_f,
+				    &fds[1]) != 0);
+	unit_check(coro_sched_wait() == reader && coro_status(reader) == 10,
+		   "the idle scheduler waits for descriptors");
+	pthread_join(thread, NULL);
+	close(fds[0]);
+	close(fds[1]);
+	coro_delete(reader);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+test_io_server_f(void *arg)
+{
+	int listen_fd = *(int *)arg;
+	int fd = coro_accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	char buf[64];
+	ssize_t rc;
+	int total = 0;
+	/* Echo until EOF. */
+	while ((rc = coro_read(fd, buf, sizeof(buf))) > 0) {
+		if (coro_write_all(fd, buf, rc) != rc)
+			break;
+		total += rc;
+	}
+	close(fd);
+	return total;
+}
+
+static int
+test_io_client_f(void *arg)
+{
+	struct sockaddr_in *addr = arg;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)addr, sizeof(*addr)) != 0) {
+		if (errno != EINPROGRESS ||
+		    coro_fd_wait(fd, CORO_FD_WRITE) != 0)
+			return -1;
+	}
+	const char *msg = "hello, coroutines";
+	int len = strlen(msg);
+	char buf[64];
+	int ok = coro_write_all(fd, msg, len) == len;
+	int total = 0;
+	while (ok && total < len) {
+		ssize_t rc = coro_read(fd, buf + total, sizeof(buf) - total);
+		ok = rc > 0;
+		total += rc;
+	}
+	close(fd);
+	return ok && memcmp(buf, msg, len) == 0 ? total : -1;
+}
+
+static void
+test_io_socket(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	unit_fail_if(listen_fd < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(bind(listen_fd, (struct sockaddr *)&addr, len) != 0);
+	unit_fail_if(listen(listen_fd, 16) != 0);
+	unit_fail_if(getsockname(listen_fd, (struct sockaddr *)&addr,
+				 &len) != 0);
+
+	struct coro *server = coro_new(test_io_server_f, &listen_fd);
+	struct coro *client = coro_new(test_io_client_f, &addr);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		continue;
+	unit_check(coro_status(client) == (int)strlen("hello, coroutines"),
+		   "the client got the echo");
+	unit_check(coro_status(server) == coro_status(client),
+		   "the server accepted and echoed");
+	coro_delete(server);
+	coro_delete(client);
+	close(listen_fd);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+enum {
+	/** Bytes per read, each part of the file has its own byte. */
+	TEST_AIO_PART = 4096,
+	/** More than the queue takes at once. */
+	TEST_AIO_PARTS = 96,
+	TEST_AIO_READERS = 4,
+};
+
+struct test_aio_reader {
+	int fd;
+	/** Reads the parts first, first + TEST_AIO_READERS, ... */
+	int first;
+	/** Counts the readers done. */
+	int *readers_done;
+};
+
+static int
+test_aio_reader_f(void *arg)
+{
+	struct test_aio_reader *r = arg;
+	enum { COUNT = TEST_AIO_PARTS / TEST_AIO_READERS };
+	char bufs[COUNT][TEST_AIO_PART];
+	struct coro_aio reqs[COUNT];
+	/* All of them in flight at once. */
+	for (int i = 0; i < COUNT; ++i) {
+		int part = r->first + i * TEST_AIO_READERS;
+		coro_aio_pread(&reqs[i], r->fd, bufs[i], TEST_AIO_PART,
+			       (off_t)part * TEST_AIO_PART);
+	}
+	int correct = 0;
+	for (int i = 0; i < COUNT; ++i) {
+		int part = r->first + i * TEST_AIO_READERS;
+		if (coro_aio_wait(&reqs[i]) != TEST_AIO_PART)
+			continue;
+		bool is_ok = true;
+		for (int j = 0; j < TEST_AIO_PART; ++j)
+			is_ok = is_ok && bufs[i][j] == (char)part;
+		correct += is_ok;
+	}
+	__atomic_add_fetch(r->readers_done, 1, __ATOMIC_SEQ_CST);
+	return correct;
+}
+
+static int
+test_aio_spinner_f(void *arg)
+{
+	int *readers_done = arg;
+	int count = 0;
+	while (__atomic_load_n(readers_done, __ATOMIC_SEQ_CST) <
+	       TEST_AIO_READERS) {
+		++count;
+		coro_yield();
+	}
+	return count;
+}
+
+static int
+test_aio_part_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char buf[TEST_AIO_PART];
+	if (coro_pread(fd, buf, sizeof(buf), TEST_AIO_PART) != sizeof(buf))
+		return -1;
+	return buf[0];
+}
+
+static int
+test_aio_quick_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/**
+ * Wait for a read in the scheduler context, while a suspended
+ * coroutine is the poller.
+ */
+static void
+test_aio_main(int fd)
+{
+	struct coro *poller = coro_new(test_aio_part_f, &fd);
+	struct coro *quick = coro_new(test_aio_quick_f, NULL);
+	unit_fail_if(coro_sched_wait() != quick);
+	coro_delete(quick);
+	char buf[TEST_AIO_PART];
+	struct coro_aio req;
+	coro_aio_pread(&req, fd, buf, sizeof(buf), 2 * TEST_AIO_PART);
+	unit_check(coro_aio_wait(&req) == sizeof(buf) && buf[0] == 2,
+		   "the scheduler context waits for a read");
+	unit_fail_if(coro_sched_wait() != poller);
+	unit_check(coro_status(poller) == 1, "and the poller is not stuck");
+	coro_delete(poller);
+}
+
+static void
+test_aio_run(int fd, const char *what)
+{
+	int readers_done = 0;
+	struct test_aio_reader readers[TEST_AIO_READERS];
+	for (int i = 0; i < TEST_AIO_READERS; ++i) {
+		readers[i].fd = fd;
+		readers[i].first = i;
+		readers[i].readers_done = &readers_done;
+		coro_new(test_aio_reader_f, &readers[i]);
+	}
+	struct coro *spinner = coro_new(test_aio_spinner_f, &readers_done);
+	int correct = 0;
+	int spins = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		if (c == spinner)
+			spins = coro_status(c);
+		else
+			correct += coro_status(c);
+		coro_delete(c);
+	}
+	unit_msg("%s", what);
+	unit_check(correct == TEST_AIO_PARTS, "all the parts are read right");
+	unit_check(spins > 0, "others run while the reads are in flight");
+}
+
+static void
+test_aio(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/coro_test_aio-XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	unlink(path);
+	static char part[TEST_AIO_PART];
+	for (int i = 0; i < TEST_AIO_PARTS; ++i) {
+		memset(part, i, sizeof(part));
+		unit_fail_if(write(fd, part, sizeof(part)) != sizeof(part));
+	}
+
+	enum coro_aio_backend backends[] = {CORO_AIO_URING, CORO_AIO_THREADS};
+	for (int i = 0; i < 2; ++i) {
+		coro_aio_set_backend(backends[i]);
+		if (coro_aio_backend() != backends[i]) {
+			unit_msg("io_uring is not available");
+			continue;
+		}
+		coro_sched_init();
+		test_aio_run(fd, i == 0 ? "io_uring" : "threads");
+		test_aio_main(fd);
+		coro_sched_destroy();
+		unit_fail_if(coro_sched_init_workers(2) != 0);
+		test_aio_run(fd, i == 0 ? "io_uring, 2 workers" :
+				 "threads, 2 workers");
+		coro_sched_destroy();
+	}
+	coro_aio_set_backend(CORO_AIO_URING);
+
+	coro_sched_init();
+	char buf[16];
+	unit_check(coro_pread(fd, buf, sizeof(buf),
+			      (off_t)TEST_AIO_PARTS * TEST_AIO_PART) == 0,
+		   "0 at the end of the file");
+	unit_check(coro_pread(-1, buf, sizeof(buf), 0) == -1 &&
+		   errno == EBADF, "errors are returned like by pread()");
+	coro_sched_destroy();
+	close(fd);
+
+	unit_test_finish();
+}
+
+static int
+test_mt_counter_f(void *arg)
+{
+	for (int i = 0; i < 100; ++i) {
+		__atomic_add_fetch((int *)arg, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return 0;
+}
+
+struct test_mt_pair {
+	struct coro *waiter;
+	int flag;
+};
+
+static int
+test_mt_waiter_f(void *arg)
+{
+	struct test_mt_pair *p = arg;
+	__atomic_store_n(&p->waiter, coro_this(), __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&p->flag, __ATOMIC_SEQ_CST) == 0)
+		coro_suspend();
+	return 1;
+}
+
+static int
+test_mt_setter_f(void *arg)
+{
+	struct test_mt_pair *p = arg;
+	struct coro *waiter;
+	while ((waiter = __atomic_load_n(&p->waiter,
+					 __ATOMIC_SEQ_CST)) == NULL)
+		coro_yield();
+	__atomic_store_n(&p->flag, 1, __ATOMIC_SEQ_CST);
+	coro_wakeup(waiter);
+	return 2;
+}
+
+static int
+test_mt_sleeper_f(void *arg)
+{
+	(void)arg;
+	/* Long enough to fail the test, if the wakeup is lost. */
+	return coro_suspend_timeout(10LL * 1000 * 1000 * 1000);
+}
+
+/** A plain thread, not a worker, wakes a coroutine up. */
+static void *
+test_mt_thread_f(void *arg)
+{
+	usleep(2000);
+	coro_wakeup(arg);
+	return NULL;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	unit_fail_if(coro_sched_init_workers(4) != 0);
+	int counter = 0;
+	int count = 100;
+	for (int i = 0; i < count; ++i)
+		coro_new(test_mt_counter_f, &counter);
+	int finished = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		unit_fail_if(!coro_is_finished(c));
+		++finished;
+		coro_delete(c);
+	}
+	unit_check(finished == count, "all coroutines are returned");
+	unit_check(counter == count * 100, "all of them did their work");
+
+	enum { PAIR_COUNT = 200 };
+	struct test_mt_pair pairs[PAIR_COUNT];
+	memset(pairs, 0, sizeof(pairs));
+	for (int i = 0; i < PAIR_COUNT; ++i) {
+		coro_new(test_mt_waiter_f, &pairs[i]);
+		coro_new(test_mt_setter_f, &pairs[i]);
+	}
+	int sum = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		sum += coro_status(c);
+		coro_delete(c);
+	}
+	unit_check(sum == PAIR_COUNT * 3,
+		   "wakeups between threads are not lost");
+
+	c = coro_new(test_mt_sleeper_f, NULL);
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, test_mt_thread_f, c) != 0);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == 0, "a plain thread can wake up");
+	pthread_join(thread, NULL);
+	coro_delete(c);
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+static int
+test_stack_f(void *arg)
+{
+	/* Touch the whole small stack, except for a margin. */
+	volatile char buf[12 * 1024];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = (char)i;
+	coro_yield();
+	int sum = 0;
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		sum += buf[i];
+	*(int *)arg = sum;
+	return 0;
+}
+
+static int
+test_stack_empty_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/** Number of memory mappings of the process. */
+static int
+test_map_count(void)
+{
+	FILE *f = fopen("/proc/self/maps", "r");
+	if (f == NULL)
+		return -1;
+	int count = 0;
+	for (int ch; (ch = fgetc(f)) != EOF;)
+		count += ch == '\n';
+	fclose(f);
+	return count;
+}
+
+/** Use about @a depth KiB of stack. */
+static int
+test_stack_deep_f_helper(int depth)
+{
+	volatile char buf[1000];
+	buf[0] = 1;
+	if (depth == 0) {
+		coro_yield();
+		return buf[0];
+	}
+	return test_stack_deep_f_helper(depth - 1) + buf[0];
+}
+
+static int
+test_stack_deep_f(void *arg)
+{
+	return test_stack_deep_f_helper(*(int *)arg);
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	coro_stack_pool_set_size(0);
+	coro_stack_pool_set_size(4);
+	struct coro_stack_pool_stat stat1, stat2;
+	coro_stack_pool_stat(&stat1);
+
+	struct coro_attr attr = {.stack_size = 16 * 1024};
+	int res = 0;
+	struct coro *c = coro_new_ex(test_stack_f, &res, &attr);
+	coro_stack_pool_stat(&stat2);
+	unit_check(stat2.misses == stat1.misses + 1 &&
+		   stat2.hits == stat1.hits, "a new stack size is a miss");
+	unit_fail_if(coro_sched_wait() != c);
+	coro_delete(c);
+	unit_check(res != 0, "a small stack is usable");
+	coro_stack_pool_stat(&stat1);
+	unit_check(stat1.count == stat2.count + 1, "the stack is cached");
+
+	c = coro_new_ex(test_stack_f, &res, &attr);
+	coro_stack_pool_stat(&stat2);
+	unit_check(stat2.hits == stat1.hits + 1 &&
+		   stat2.misses == stat1.misses, "the same size is a hit");
+	unit_fail_if(coro_sched_wait() != c);
+	coro_delete(c);
+
+	for (int i = 0; i < 8; ++i)
+		coro_new_ex(test_stack_f, &res, &attr);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_stack_pool_stat(&stat1);
+	unit_check(stat1.count == 4, "the pool size is limited");
+	coro_stack_pool_set_size(0);
+	coro_stack_pool_stat(&stat1);
+	unit_check(stat1.count == 0, "the pool can be emptied");
+
+	/* The default stack grows lazily, and all of it is usable. */
+	int depth = 900;
+	for (int i = 0; i < 2; ++i)
+		coro_new(test_stack_deep_f, &depth);
+	coro_stack_pool_set_size(4);
+	bool is_ok = true;
+	for (int i = 0; i < 4; ++i) {
+		c = coro_sched_wait();
+		is_ok = is_ok && coro_status(c) == depth + 1;
+		coro_delete(c);
+		if (i < 2)
+			coro_new(test_stack_deep_f, &depth);
+	}
+	unit_check(is_ok, "deep recursion on a default stack");
+	coro_stack_pool_stat(&stat1);
+	unit_check(stat1.hits >= stat2.hits + 2, "deep stacks are reused");
+
+	/*
+	 * Guarded stacks take 2 mappings each, so that many would
+	 * not fit into the default vm.max_map_count.
+	 */
+	int count = 65530 / 2 + 1000;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		int max_count;
+		if (fscanf(f, "%d", &max_count) == 1)
+			count = max_count / 2 + 1000;
+		fclose(f);
+	}
+	int map_count = test_map_count();
+	attr.no_guard = true;
+	for (int i = 0; i < count; ++i)
+		coro_new_ex(test_stack_empty_f, NULL, &attr);
+	unit_check(test_map_count() - map_count < count / 2,
+		   "stacks without guards share mappings");
+	int finished = 0;
+	while ((c = coro_sched_wait()) != NULL) {
+		finished += coro_status(c) == 0;
+		coro_delete(c);
+	}
+	unit_check(finished == count, "more coroutines than mappings");
+	attr.no_guard = false;
+	coro_stack_pool_stat(&stat1);
+	c = coro_new_ex(test_stack_f, &res, &attr);
+	coro_stack_pool_stat(&stat2);
+	unit_check(stat1.count == 4 && stat2.misses == stat1.misses + 1,
+		   "unguarded stacks are not reused for guarded ones");
+	unit_fail_if(coro_sched_wait() != c);
+	coro_delete(c);
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_QUANTUM_NS = 2 * 1000 * 1000,
+	TEST_QUANTUM_WORK_NS = 20 * 1000 * 1000,
+};
+
+static long long
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+test_quantum_f(void *arg)
+{
+	(void)arg;
+	struct coro *this = coro_this();
+	int yields = 0;
+	while (coro_run_time(this) < TEST_QUANTUM_WORK_NS) {
+		if (coro_yield_if_expired())
+			++yields;
+	}
+	return yields;
+}
+
+static int
+test_sleepy_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	return 0;
+}
+
+static void
+test_quantum(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_attr attr = {.quantum = TEST_QUANTUM_NS};
+	struct coro *c = coro_new_ex(test_quantum_f, NULL, &attr);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == 0, "a lone coroutine never yields");
+	unit_check(coro_switch_count(c) == 0, "and is not switched");
+	coro_delete(c);
+
+	struct coro *c1 = coro_new_ex(test_quantum_f, NULL, &attr);
+	struct coro *c2 = coro_new_ex(test_quantum_f, NULL, &attr);
+	int max_yields = TEST_QUANTUM_WORK_NS / TEST_QUANTUM_NS;
+	for (int i = 0; i < 2; ++i) {
+		c = coro_sched_wait();
+		unit_fail_if(c != c1 && c != c2);
+		unit_check(coro_status(c) > 0 && coro_status(c) <= max_yields,
+			   "the quantum is respected");
+		unit_check(coro_run_time(c) >= TEST_QUANTUM_WORK_NS,
+			   "the run time is accounted");
+		coro_delete(c);
+	}
+
+	/* A negative quantum is unlimited, like in coro_set_quantum(). */
+	attr.quantum = -1;
+	c1 = coro_new_ex(test_quantum_f, NULL, &attr);
+	c2 = coro_new_ex(test_quantum_f, NULL, &attr);
+	for (int i = 0; i < 2; ++i) {
+		c = coro_sched_wait();
+		unit_fail_if(c != c1 && c != c2);
+		unit_check(coro_status(c) == 0,
+			   "a negative quantum never expires");
+		coro_delete(c);
+	}
+
+	c = coro_new(test_sleepy_f, NULL);
+	coro_yield();
+	long long start = test_now_ns();
+	while (test_now_ns() - start < TEST_QUANTUM_WORK_NS)
+		;
+	coro_wakeup(c);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_run_time(c) < TEST_QUANTUM_WORK_NS / 2,
+		   "a suspended coroutine does not accumulate run time");
+	coro_delete(c);
+
+	unit_test_finish();
+}
+
+static int test_destructor_calls;
+
+static void
+test_destructor(void *value)
+{
+	(void)value;
+	++test_destructor_calls;
+}
+
+struct test_locals_arg {
+	int key;
+	int id;
+	bool is_ok;
+};
+
+static int
+test_locals_f(void *arg)
+{
+	struct test_locals_arg *a = arg;
+	a->is_ok = coro_key_get(a->key) == NULL;
+	coro_key_set(a->key, a);
+	int *small = coro_alloc(sizeof(int));
+	*small = a->id;
+	coro_yield();
+	/* Bigger than a chunk. */
+	size_t big_size = 1024 * 1024;
+	char *big = coro_alloc(big_size);
+	memset(big, a->id, big_size);
+	coro_yield();
+	a->is_ok = a->is_ok && coro_key_get(a->key) == a &&
+		   *small == a->id && big[big_size - 1] == a->id &&
+		   ((uintptr_t)big & 15) == 0;
+	coro_arena_free(big);
+	a->is_ok = a->is_ok && coro_alloc(big_size) == big;
+	coro_arena_free(small);
+	a->is_ok = a->is_ok && coro_alloc(1) == small;
+	return 0;
+}
+
+static void
+test_locals(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int key = coro_key_create(test_destructor);
+	unit_fail_if(key < 0);
+	struct test_locals_arg args[3];
+	for (int i = 0; i < 3; ++i) {
+		args[i].key = key;
+		args[i].id = i + 1;
+		coro_new(test_locals_f, &args[i]);
+	}
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	bool is_ok = true;
+	for (int i = 0; i < 3; ++i)
+		is_ok = is_ok && args[i].is_ok;
+	unit_check(is_ok, "each coroutine has own locals and arena");
+	unit_check(test_destructor_calls == 3,
+		   "the destructors are called in coro_delete()");
+
+	int key2 = coro_key_create(NULL);
+	unit_check(key2 >= 0 && key2 != key, "keys are unique");
+	while (coro_key_create(NULL) >= 0)
+		;
+	unit_check(errno == EAGAIN, "the keys are limited");
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_MS = 1000 * 1000,
+};
+
+struct test_sleep_arg {
+	long long duration;
+	long long slept;
+	int *order;
+	int *order_size;
+	int id;
+};
+
+static int
+test_sleep_f(void *arg)
+{
+	struct test_sleep_arg *a = arg;
+	long long start = test_now_ns();
+	coro_sleep(a->duration);
+	a->slept = test_now_ns() - start;
+	if (a->order != NULL)
+		a->order[(*a->order_size)++] = a->id;
+	return 0;
+}
+
+static int
+test_timeout_f(void *arg)
+{
+	(void)arg;
+	int rc = coro_suspend_timeout(5 * TEST_MS);
+	return rc == -1 && errno == ETIMEDOUT;
+}
+
+static int
+test_timeout_waker_f(void *arg)
+{
+	coro_sleep(TEST_MS);
+	coro_wakeup(arg);
+	return 0;
+}
+
+static int
+test_timeout_woken_f(void *arg)
+{
+	(void)arg;
+	long long start = test_now_ns();
+	int rc = coro_suspend_timeout(1000 * TEST_MS);
+	if (rc != 0 || test_now_ns() - start > 500 * TEST_MS)
+		return 0;
+	/* The removed timer does not fire later. */
+	rc = coro_suspend_timeout(20 * TEST_MS);
+	return rc == -1 && errno == ETIMEDOUT;
+}
+
+static long long
+test_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	int order[3];
+	int order_size = 0;
+	struct test_sleep_arg args[3];
+	long long durations[3] = {30 * TEST_MS, 10 * TEST_MS, 20 * TEST_MS};
+	for (int i = 0; i < 3; ++i) {
+		args[i].duration = durations[i];
+		args[i].order = order;
+		args[i].order_size = &order_size;
+		args[i].id = i;
+		coro_new(test_sleep_f, &args[i]);
+	}
+	long long cpu_start = test_cpu_ns();
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	long long cpu = test_cpu_ns() - cpu_start;
+	unit_check(order_size == 3 && order[0] == 1 && order[1] == 2 &&
+		   order[2] == 0, "sleepers wake up in the deadline order");
+	bool is_ok = true;
+	for (int i = 0; i < 3; ++i)
+		is_ok = is_ok && args[i].slept >= args[i].duration;
+	unit_check(is_ok, "the sleep is not shorter than asked");
+	unit_check(cpu < 15 * TEST_MS, "the scheduler sleeps, not spins");
+
+	c = coro_new(test_timeout_f, NULL);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == 1, "suspension times out");
+	coro_delete(c);
+
+	struct coro *woken = coro_new(test_timeout_woken_f, NULL);
+	coro_new(test_timeout_waker_f, woken);
+	while ((c = coro_sched_wait()) != NULL) {
+		if (c == woken)
+			unit_check(coro_status(c) == 1,
+				   "a wakeup cancels the timeout");
+		coro_delete(c);
+	}
+
+	unit_fail_if(coro_sched_init_workers(2) != 0);
+	struct test_sleep_arg mt_args[100];
+	for (int i = 0; i < 100; ++i) {
+		mt_args[i].duration = (1 + i % 10) * TEST_MS;
+		mt_args[i].order = NULL;
+		coro_new(test_sleep_f, &mt_args[i]);
+	}
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	is_ok = true;
+	for (int i = 0; i < 100; ++i)
+		is_ok = is_ok && mt_args[i].slept >= mt_args[i].duration;
+	unit_check(is_ok, "sleep works on worker threads");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_CHAN_PRODUCERS = 4,
+	TEST_CHAN_CONSUMERS = 3,
+	TEST_CHAN_MESSAGES = 1000,
+};
+
+struct test_chan_arg {
+	struct coro_chan *ch;
+	/** Producers: first message to send. Consumers: sum. */
+	long long value;
+	/** Consumers: true, if the messages of each producer are ordered. */
+	bool is_ordered;
+};
+
+static int
+test_chan_producer_f(void *arg)
+{
+	struct test_chan_arg *a = arg;
+	for (int i = 0; i < TEST_CHAN_MESSAGES; ++i) {
+		if (coro_chan_send(a->ch, (void *)(size_t)(a->value + i)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+test_chan_consumer_f(void *arg)
+{
+	struct test_chan_arg *a = arg;
+	long long last[TEST_CHAN_PRODUCERS];
+	for (int i = 0; i < TEST_CHAN_PRODUCERS; ++i)
+		last[i] = -1;
+	a->value = 0;
+	a->is_ordered = true;
+	void *msg;
+	while (coro_chan_recv(a->ch, &msg) == 0) {
+		long long v = (size_t)msg;
+		int producer = v / TEST_CHAN_MESSAGES;
+		if (v <= last[producer])
+			a->is_ordered = false;
+		last[producer] = v;
+		a->value += v;
+	}
+	return errno == EPIPE ? 0 : -1;
+}
+
+/**
+ * Producers and consumers over one channel. The channel is closed
+ * when all the producers are done.
+ */
+static bool
+test_chan_run(int capacity, int workers)
+{
+	unit_fail_if(coro_sched_init_workers(workers) != 0);
+	struct coro_chan *ch = coro_chan_new(capacity);
+	struct test_chan_arg producers[TEST_CHAN_PRODUCERS];
+	struct test_chan_arg consumers[TEST_CHAN_CONSUMERS];
+	struct coro *producer_coros[TEST_CHAN_PRODUCERS];
+	for (int i = 0; i < TEST_CHAN_CONSUMERS; ++i) {
+		consumers[i].ch = ch;
+		coro_new(test_chan_consumer_f, &consumers[i]);
+	}
+	for (int i = 0; i < TEST_CHAN_PRODUCERS; ++i) {
+		producers[i].ch = ch;
+		producers[i].value = i * TEST_CHAN_MESSAGES;
+		producer_coros[i] =
+			coro_new(test_chan_producer_f, &producers[i]);
+	}
+	int producers_left = TEST_CHAN_PRODUCERS;
+	bool is_ok = true;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		is_ok = is_ok && coro_status(c) == 0;
+		for (int i = 0; i < TEST_CHAN_PRODUCERS; ++i) {
+			if (c == producer_coros[i] && --producers_left == 0)
+				coro_chan_close(ch);
+		}
+		coro_delete(c);
+	}
+	coro_chan_delete(ch);
+	coro_sched_destroy();
+	long long total = 0;
+	for (int i = 0; i < TEST_CHAN_CONSUMERS; ++i) {
+		total += consumers[i].value;
+		is_ok = is_ok && consumers[i].is_ordered;
+	}
+	long long count = TEST_CHAN_PRODUCERS * TEST_CHAN_MESSAGES;
+	return is_ok && total == count * (count - 1) / 2;
+}
+
+static int
+test_chan_closed_sender_f(void *arg)
+{
+	int rc1 = coro_chan_send(arg, (void *)1);
+	int rc2 = coro_chan_send(arg, (void *)2);
+	return rc1 == 0 && rc2 == -1 && errno == EPIPE;
+}
+
+static void
+test_chan(void)
+{
+	unit_test_start();
+
+	unit_check(test_chan_run(0, 0), "unbuffered channel");
+	unit_check(test_chan_run(1, 0), "channel of 1 message");
+	unit_check(test_chan_run(16, 0), "buffered channel");
+	unit_check(test_chan_run(0, 2), "unbuffered channel, workers");
+	unit_check(test_chan_run(16, 2), "buffered channel, workers");
+
+	coro_sched_init();
+	struct coro_chan *ch = coro_chan_new(1);
+	struct coro *c = coro_new(test_chan_closed_sender_f, ch);
+	unit_fail_if(coro_sched_wait() != NULL);
+	coro_chan_close(ch);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == 1, "close fails the blocked sender");
+	coro_delete(c);
+	void *msg;
+	unit_check(coro_chan_recv(ch, &msg) == 0 && msg == (void *)1,
+		   "buffered messages survive close");
+	unit_check(coro_chan_recv(ch, &msg) == -1 && errno == EPIPE,
+		   "closed and empty channel fails");
+	coro_chan_delete(ch);
+
+	unit_test_finish();
+}
+
+static int
+test_group_yield_f(void *arg)
+{
+	int *counter = arg;
+	for (int i = 0; i < 10; ++i) {
+		__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return 0;
+}
+
+static int
+test_group_fail_f(void *arg)
+{
+	coro_sleep(TEST_MS);
+	return (int)(size_t)arg;
+}
+
+/** Stragglers of different kinds, each should notice cancellation. */
+static int
+test_group_spin_f(void *arg)
+{
+	(void)arg;
+	while (!coro_is_cancelled())
+		coro_yield();
+	return -1;
+}
+
+static int
+test_group_sleep_f(void *arg)
+{
+	(void)arg;
+	coro_sleep(10000LL * TEST_MS);
+	return coro_is_cancelled() ? -1 : 0;
+}
+
+static int
+test_group_chan_f(void *arg)
+{
+	void *msg;
+	int rc = coro_chan_recv(arg, &msg);
+	return rc == -1 && errno == ECANCELED ? -1 : 0;
+}
+
+static int
+test_group_timeout_f(void *arg)
+{
+	(void)arg;
+	int rc = coro_suspend_timeout(10000LL * TEST_MS);
+	return rc == -1 && errno == ECANCELED ? -1 : 0;
+}
+
+static int
+test_group_fd_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int rc = coro_fd_wait(fd, CORO_FD_READ);
+	return rc == -1 && errno == ECANCELED ? -1 : 0;
+}
+
+/** Cancelled before start, so nothing should block. */
+static int
+test_group_late_f(void *arg)
+{
+	long long *elapsed = arg;
+	long long start = test_now_ns();
+	coro_sleep(10000LL * TEST_MS);
+	int rc = coro_suspend_timeout(10000LL * TEST_MS);
+	if (rc == -1 && errno == ECANCELED)
+		*elapsed = test_now_ns() - start;
+	return -1;
+}
+
+/** Run stragglers, cancel them after a while, join. */
+static int
+test_group_supervisor_f(void *arg)
+{
+	struct coro_group *g = coro_group_new();
+	struct coro_attr attr = {.group = g};
+	coro_new_ex(test_group_spin_f, NULL, &attr);
+	coro_new_ex(test_group_sleep_f, NULL, &attr);
+	coro_sleep(2 * TEST_MS);
+	coro_group_cancel(g);
+	/* Cancelled already at start. */
+	coro_new_ex(test_group_late_f, arg, &attr);
+	int rc = coro_group_join(g);
+	coro_group_delete(g);
+	return rc;
+}
+
+static void
+test_group(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct coro_group *g = coro_group_new();
+	struct coro_attr attr = {.group = g};
+	int counter = 0;
+	for (int i = 0; i < 5; ++i)
+		coro_new_ex(test_group_yield_f, &counter, &attr);
+	int other_counter = 0;
+	struct coro *other = coro_new(test_group_yield_f, &other_counter);
+	unit_check(coro_group_join(g) == 0 && counter == 50,
+		   "join waits for all the children");
+	unit_check(coro_sched_wait() == other,
+		   "other coroutines are left to coro_sched_wait()");
+	coro_delete(other);
+	unit_check(coro_sched_wait() == NULL, "children are not returned");
+
+	struct coro_chan *ch = coro_chan_new(0);
+	long long start = test_now_ns();
+	coro_new_ex(test_group_spin_f, NULL, &attr);
+	coro_new_ex(test_group_sleep_f, NULL, &attr);
+	coro_new_ex(test_group_chan_f, ch, &attr);
+	coro_new_ex(test_group_timeout_f, NULL, &attr);
+	coro_new_ex(test_group_fail_f, (void *)7, &attr);
+	coro_new_ex(test_group_fail_f, (void *)8, &attr);
+	unit_check(coro_group_join(g) == 7, "the first error is returned");
+	unit_check(test_now_ns() - start < 1000 * TEST_MS,
+		   "the error cancels the stragglers");
+	coro_chan_delete(ch);
+	coro_group_delete(g);
+
+	long long late_elapsed = -1;
+	struct coro *c = coro_new(test_group_supervisor_f, &late_elapsed);
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_status(c) == -1, "a coroutine can cancel and join");
+	unit_check(late_elapsed >= 0 && late_elapsed < 1000 * TEST_MS,
+		   "a cancelled child does not suspend");
+	coro_delete(c);
+
+	unit_fail_if(coro_sched_init_workers(2) != 0);
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	unit_fail_if(fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0);
+	g = coro_group_new();
+	attr.group = g;
+	counter = 0;
+	for (int i = 0; i < 20; ++i)
+		coro_new_ex(test_group_yield_f, &counter, &attr);
+	coro_new_ex(test_group_spin_f, NULL, &attr);
+	coro_new_ex(test_group_sleep_f, NULL, &attr);
+	coro_new_ex(test_group_fd_f, &fds[0], &attr);
+	coro_new_ex(test_group_fail_f, (void *)5, &attr);
+	unit_check(coro_group_join(g) == 5 && counter == 200,
+		   "join and cancellation on worker threads");
+	coro_group_delete(g);
+	/*
+	 * The cancelled descriptor waiter is deleted already, and
+	 * must not be left in the scheduler it waited on.
+	 */
+	unit_fail_if(write(fds[1], "0123456789", 10) != 10);
+	c = coro_new(test_io_reader_f, &fds[0]);
+	unit_check(coro_sched_wait() == c && coro_status(c) == 10,
+		   "a cancelled descriptor waiter leaves no trace");
+	coro_delete(c);
+	close(fds[0]);
+	close(fds[1]);
+	unit_check(coro_sched_wait() == NULL, "nothing is left");
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+/** Order in which the coroutines of test_policy() ran. */
+static struct {
+	int ids[64];
+	int count;
+} test_policy_log;
+
+static int
+test_policy_f(void *arg)
+{
+	int id = (int)(long)arg;
+	for (int i = 0; i < 3; ++i) {
+		test_policy_log.ids[test_policy_log.count++] = id;
+		coro_yield();
+	}
+	return 0;
+}
+
+static bool
+test_policy_log_is(const int *ids, int count)
+{
+	if (test_policy_log.count != count)
+		return false;
+	for (int i = 0; i < count; ++i) {
+		if (test_policy_log.ids[i] != ids[i])
+			return false;
+	}
+	return true;
+}
+
+static void
+test_policy_run(void)
+{
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+}
+
+static void
+test_policy(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	coro_sched_set_policy(CORO_SCHED_PRIORITY);
+	int priorities[] = {1, 5, 3};
+	test_policy_log.count = 0;
+	for (int i = 0; i < 3; ++i) {
+		struct coro_attr attr = {.priority = priorities[i]};
+		coro_new_ex(test_policy_f, (void *)(long)priorities[i], &attr);
+	}
+	test_policy_run();
+	int prio_order[] = {5, 5, 5, 3, 3, 3, 1, 1, 1};
+	unit_check(test_policy_log_is(prio_order, 9),
+		   "higher priority runs first and keeps running on yield");
+
+	test_policy_log.count = 0;
+	for (int i = 0; i < 2; ++i) {
+		struct coro_attr attr = {.priority = 2};
+		coro_new_ex(test_policy_f, (void *)(long)i, &attr);
+	}
+	test_policy_run();
+	int same_order[] = {0, 1, 0, 1, 0, 1};
+	unit_check(test_policy_log_is(same_order, 6),
+		   "round-robin on the same priority");
+
+	coro_sched_set_policy(CORO_SCHED_EDF);
+	long long latencies[] = {30 * TEST_MS, 10 * TEST_MS, 0, 20 * TEST_MS};
+	test_policy_log.count = 0;
+	for (int i = 0; i < 4; ++i) {
+		struct coro_attr attr = {.latency = latencies[i]};
+		coro_new_ex(test_policy_f, (void *)(long)i, &attr);
+	}
+	test_policy_run();
+	int edf_order[] = {1, 1, 1, 3, 3, 3, 0, 0, 0, 2, 2, 2};
+	unit_check(test_policy_log_is(edf_order, 12),
+		   "earliest deadline first, no deadline last");
+
+	coro_sched_init();
+	struct coro_attr attr = {.histograms = true};
+	struct coro *c = coro_new_ex(test_policy_f, NULL, &attr);
+	struct coro *other = coro_new(test_policy_f, NULL);
+	struct coro_hist wait, run;
+	unit_check(coro_histograms(other, &wait, &run) == -1,
+		   "histograms are off by default");
+	test_policy_log.count = 0;
+	unit_fail_if(coro_sched_wait() != c);
+	unit_check(coro_histograms(c, &wait, &run) == 0 &&
+		   wait.count == 4 && run.count == 4,
+		   "each switch to and from is counted");
+	unit_check(coro_hist_percentile(&run, 50) <=
+		   coro_hist_percentile(&run, 99) &&
+		   coro_hist_percentile(&run, 100) == run.max &&
+		   run.sum >= run.max, "percentiles are ordered");
+	coro_delete(c);
+	unit_fail_if(coro_sched_wait() != other);
+	coro_delete(other);
+
+	unit_fail_if(coro_sched_init_workers(2) != 0);
+	for (int policy = CORO_SCHED_PRIORITY; policy <= CORO_SCHED_EDF;
+	     ++policy) {
+		coro_sched_set_policy(policy);
+		int counter = 0;
+		for (int i = 0; i < 20; ++i) {
+			attr = (struct coro_attr){
+				.priority = i % 4,
+				.latency = (i % 3) * TEST_MS,
+			};
+			coro_new_ex(test_group_yield_f, &counter, &attr);
+		}
+		int count = 0;
+		while ((c = coro_sched_wait()) != NULL) {
+			coro_delete(c);
+			++count;
+		}
+		unit_check(count == 20 && counter == 200,
+			   "policies work on worker threads");
+	}
+	coro_sched_destroy();
+
+	unit_test_finish();
+}
+
+/** Count the occurrences of a string in a file. */
+static int
+test_count_in_file(const char *path, const char *str)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	static char buf[1 << 16];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[size] = 0;
+	int count = 0;
+	for (char *pos = strstr(buf, str); pos != NULL;
+	     pos = strstr(pos + 1, str))
+		++count;
+	return count;
+}
+
+static int
+test_trace_f(void *arg)
+{
+	(void)arg;
+	coro_yield();
+	coro_yield();
+	return 0;
+}
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	const char *path = "trace.json";
+	coro_sched_init();
+	unit_fail_if(coro_trace_start(1024) != 0);
+	coro_new(test_trace_f, NULL);
+	coro_new(test_trace_f, NULL);
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_trace_stop();
+	unit_fail_if(coro_trace_dump(path) != 0);
+	/*
+	 * Run 1, yield 1 to 2, 2 to 1, 1 to 2, 2 to 1, finish 1 to
+	 * the scheduler, run 2, finish 2. A slice lasts between two
+	 * switches and is named by the ending one.
+	 */
+	unit_check(test_count_in_file(path, "\"ph\":\"X\"") == 7,
+		   "each switch starts a slice");
+	unit_check(test_count_in_file(path, "\"end\":\"yield\"") == 4,
+		   "yields are traced");
+	unit_check(test_count_in_file(path, "\"end\":\"finish\"") == 2 &&
+		   test_count_in_file(path, "\"end\":\"run\"") == 1 &&
+		   test_count_in_file(path, "scheduler") == 1,
+		   "finishes and runs are traced");
+
+	unit_fail_if(coro_trace_start(4) != 0);
+	for (int i = 0; i < 10; ++i)
+		coro_new(test_trace_f, NULL);
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	unit_fail_if(coro_trace_dump(path) != 0);
+	unit_check(test_count_in_file(path, "\"ph\":\"X\"") == 3,
+		   "the ring keeps the last events");
+	coro_trace_stop();
+	unlink(path);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_basic();
+	test_status();
+	test_fp();
+	test_round_robin();
+	test_suspend();
+	test_io_pipe();
+	test_io_socket();
+	test_aio();
+	test_mt();
+	test_stack_pool();
+	test_quantum();
+	test_locals();
+	test_sleep();
+	test_chan();
+	test_group();
+	test_trace();
+	test_policy();
+
+	unit_test_finish();
+	return 0;
+}